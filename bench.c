@@ -0,0 +1,141 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "smoldtb.h"
+
+/* Measures how fast dtb_read_prop_*() decode a large property, in cells per nanosecond. Build
+ * with `make bench`, and compare against BENCH_FLAGS="-O2 -mssse3" or -DSMOLDTB_NO_SIMD to see
+ * the effect of the SIMD paths.
+ */
+
+#define BENCH_CELLS 0x10000
+#define BENCH_RUNS 200
+
+static uint64_t blob[(BENCH_CELLS + 64) / 2];
+
+static void put_be32(uint8_t* dest, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+        dest[i] = (uint8_t)(value >> (24 - i * 8));
+}
+
+/* Creates a blob with a single node, containing a property of BENCH_CELLS cells. */
+static uintptr_t make_blob()
+{
+    static const char strings[] = "data";
+    uint8_t* data = (uint8_t*)blob;
+    const size_t struct_offset = 40 + 16;
+    const size_t struct_len = (2 + 3 + BENCH_CELLS + 2) * 4;
+    const size_t strings_offset = struct_offset + struct_len;
+
+    memset(data, 0, struct_offset);
+    put_be32(data + 0, 0xd00dfeed);
+    put_be32(data + 4, strings_offset + sizeof(strings));
+    put_be32(data + 8, struct_offset);
+    put_be32(data + 12, strings_offset);
+    put_be32(data + 16, 40);
+    put_be32(data + 20, 17);
+    put_be32(data + 24, 16);
+    put_be32(data + 32, sizeof(strings));
+    put_be32(data + 36, struct_len);
+
+    uint8_t* cell = data + struct_offset;
+    put_be32(cell, 1); //FDT_BEGIN_NODE, with an empty name for the root
+    put_be32(cell + 4, 0);
+    put_be32(cell + 8, 3); //FDT_PROP
+    put_be32(cell + 12, BENCH_CELLS * 4);
+    put_be32(cell + 16, 0);
+    cell += 20;
+    uint32_t seed = 1;
+    for (size_t i = 0; i < BENCH_CELLS; i++, cell += 4)
+    {
+        seed = seed * 1103515245u + 12345u;
+        put_be32(cell, seed);
+    }
+    put_be32(cell, 2); //FDT_END_NODE
+    put_be32(cell + 4, 9); //FDT_END
+    memcpy(data + strings_offset, strings, sizeof(strings));
+
+    return (uintptr_t)data;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t checksum(const smoldtb_value* vals, size_t count)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++)
+        sum = sum * 31 + vals[i];
+    return sum;
+}
+
+static smoldtb_value vals[BENCH_CELLS];
+
+static void* bench_malloc(size_t length)
+{
+    return malloc(length);
+}
+
+static void bench_free(void* ptr, size_t length)
+{
+    (void)length;
+    free(ptr);
+}
+
+/* Runs one read BENCH_RUNS times and prints the best time, the read returns how many values it
+ * wrote to vals.
+ */
+#define BENCH(title, read) \
+    do \
+    { \
+        double best = 0; \
+        size_t count = 0; \
+        for (size_t run = 0; run < BENCH_RUNS; run++) \
+        { \
+            const double begin = now_ns(); \
+            count = (read); \
+            const double elapsed = now_ns() - begin; \
+            if (run == 0 || elapsed < best) \
+                best = elapsed; \
+        } \
+        printf("%-26s %6.2f cells/ns  (checksum %016llx)\r\n", title, BENCH_CELLS / best, \
+            (unsigned long long)checksum(vals, count)); \
+    } while (0)
+
+int main()
+{
+    dtb_ops ops = { 0 };
+    ops.malloc = bench_malloc;
+    ops.free = bench_free;
+    if (!dtb_init(make_blob(), ops))
+    {
+        printf("dtb_init() failed\r\n");
+        return 1;
+    }
+
+    dtb_prop* prop = dtb_find_prop(dtb_find("/"), "data");
+    if (prop == NULL)
+    {
+        printf("benchmark property is missing\r\n");
+        return 1;
+    }
+
+    const dtb_pair pair_2_2 = { 2, 2 };
+    const dtb_pair pair_1_1 = { 1, 1 };
+    const dtb_triplet triplet_3_2_2 = { 3, 2, 2 };
+    printf("%u cell property, best of %u runs\r\n", BENCH_CELLS, BENCH_RUNS);
+    BENCH("read_prop_1, 1 cell", dtb_read_prop_1(prop, 1, vals));
+    BENCH("read_prop_1, 2 cells", dtb_read_prop_1(prop, 2, vals));
+    BENCH("read_prop_2 <2 2>", 2 * dtb_read_prop_2(prop, pair_2_2, (dtb_pair*)vals));
+    BENCH("read_prop_2 <1 1>", 2 * dtb_read_prop_2(prop, pair_1_1, (dtb_pair*)vals));
+    BENCH("read_prop_3 <3 2 2>", 3 * dtb_read_prop_3(prop, triplet_3_2_2, (dtb_triplet*)vals));
+
+    return 0;
+}
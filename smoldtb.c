@@ -7,14 +7,73 @@
 #define FDT_END_NODE 2
 #define FDT_PROP 3
 #define FDT_NOP 4
+#define FDT_END 9
 
 #define FDT_VERSION 17
 #define FDT_CELL_SIZE 4
 #define ROOT_NODE_STR "\'/\'"
+#define ARENA_MIN_PAGE_ELEMS 64
+#define PHANDLE_MIN_CAPACITY 16
+#define COMPAT_MIN_CAPACITY 16
+#define PATH_MIN_CAPACITY 16
+#define RANGES_MIN_CAPACITY 16
+#define IRQ_MIN_CAPACITY 16
+#define IRQ_ADDR_CELLS 3
+#define IRQ_KEY_CELLS (IRQ_ADDR_CELLS + SMOLDTB_MAX_INTERRUPT_CELLS)
+#define IRQ_MAX_DEPTH 64
+#define BUFF_ALIGN 16
+#define STREAM_SCRATCH_SIZE 256
+#define MATCH_MAX_SLOTS 1024
+
+/* What the next bytes of a blob passed to dtb_feed() are part of */
+#define STREAM_STEP_IDLE 0
+#define STREAM_STEP_HEADER 1
+#define STREAM_STEP_SEEK 2
+#define STREAM_STEP_RESV 3
+#define STREAM_STEP_TOKEN 4
+#define STREAM_STEP_NODE_NAME 5
+#define STREAM_STEP_PROP_HEADER 6
+#define STREAM_STEP_PROP_DATA 7
+#define STREAM_STEP_DONE 8
+
+/* Properties that are cached per node when built with SMOLDTB_PROP_SLOTS */
+#define KNOWN_PROP_COMPATIBLE 0
+#define KNOWN_PROP_REG 1
+#define KNOWN_PROP_STATUS 2
+#define KNOWN_PROP_PHANDLE 3
+#define KNOWN_PROP_ADDR_CELLS 4
+#define KNOWN_PROP_SIZE_CELLS 5
+#define KNOWN_PROP_INTERRUPTS 6
+#define KNOWN_PROP_RANGES 7
+#define KNOWN_PROP_COUNT 8
 
 #define SMOLDTB_FOREACH_CONTINUE 0
 #define SMOLDTB_FOREACH_ABORT 1
 
+/* Bulk cell decoding uses SIMD when the compiler targets it, unless SMOLDTB_NO_SIMD is defined */
+#if !defined(SMOLDTB_NO_SIMD) && defined(__SSSE3__)
+    #include <tmmintrin.h>
+    #define CELLS_SIMD_SSSE3
+#elif !defined(SMOLDTB_NO_SIMD) && defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    #include <arm_neon.h>
+    #define CELLS_SIMD_NEON
+#endif
+
+/* With SMOLDTB_ENABLE_CONTEXTS the context used by the API is selected through current_state,
+ * which is thread-local so each thread can use a different context. Hosted compilers have a
+ * keyword for this, freestanding code often doesn't have TLS available so SMOLDTB_THREAD_LOCAL
+ * must be defined there (it may be empty if only one thread will use the library).
+ */
+#if defined(SMOLDTB_ENABLE_CONTEXTS) && !defined(SMOLDTB_THREAD_LOCAL)
+    #if __STDC_HOSTED__ && defined(__GNUC__)
+        #define SMOLDTB_THREAD_LOCAL __thread
+    #elif __STDC_HOSTED__ && defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+        #define SMOLDTB_THREAD_LOCAL _Thread_local
+    #else
+        #error "Contexts and snapshots need SMOLDTB_THREAD_LOCAL defined to the compiler's thread-local keyword (or empty if only one thread uses the library)"
+    #endif
+#endif
+
 #ifndef SMOLDTB_NO_LOGGING
     #define LOG_ERROR(msg) do { if (state.ops.on_error != NULL) { state.ops.on_error(msg); }} while(false)
 #else
@@ -50,6 +109,35 @@ struct fdt_property
     uint32_t name_offset;
 };
 
+#if defined(SMOLDTB_COMPACT_NODES) && !defined(SMOLDTB_STATIC_BUFFER_SIZE)
+    #error "SMOLDTB_COMPACT_NODES requires SMOLDTB_STATIC_BUFFER_SIZE"
+#endif
+
+#if defined(SMOLDTB_ENABLE_STREAMING) && (defined(SMOLDTB_LAZY_PARSE) || defined(SMOLDTB_COMPACT_NODES))
+    /* both of these need the whole blob in one place, after parsing */
+    #error "SMOLDTB_ENABLE_STREAMING can't be used with SMOLDTB_LAZY_PARSE or SMOLDTB_COMPACT_NODES"
+#endif
+
+/* Links between nodes and properties, and their names and data. Normally these are just
+ * pointers. Compact builds store node and property links as 32-bit offsets into the static
+ * buffer (where the arenas live), and names and data as 32-bit offsets into either the blob or
+ * the static buffer (marked with REF_IN_BUFF). An offset of 0 is used for NULL. These fields should
+ * only be accessed through the node_*() and prop_*() functions, and set with the ref_*()
+ * functions.
+ */
+#ifdef SMOLDTB_COMPACT_NODES
+#define REF_IN_BUFF 0x80000000u
+typedef uint32_t node_ref;
+typedef uint32_t prop_ref;
+typedef uint32_t str_ref;
+typedef uint32_t data_ref;
+#else
+typedef dtb_node* node_ref;
+typedef dtb_prop* prop_ref;
+typedef const char* str_ref;
+typedef void* data_ref;
+#endif
+
 /* The tree is represented in horizontal slices, where all child nodes are represented
  * in a singly-linked list. Only a pointer to the first child is stored in the parent, and
  * the list is build using the node->sibling pointer.
@@ -58,30 +146,197 @@ struct fdt_property
  * - sibling: the next node on this level. To access the previous node, access the parent and then
  *            the child pointer and iterate to just before the target.
  * - child: the first child node.
+ * Children are kept in the same order as the source blob. Each node also stores 'subtree_end': the
+ * next node in a depth-first (pre-order) walk of the tree once this node's descendants have been
+ * visited, or NULL if there isn't one. This lets a walk skip a subtree, or stop at the end of one,
+ * without climbing back up the tree. Nodes are allocated in this same order, so walking the tree
+ * mostly moves forwards through memory.
+ * The number of children and properties, and the node's position in its parent's list of children
+ * are kept up to date as nodes are parsed or modified, so dtb_stat_node() doesn't need to count them.
+ * When built with SMOLDTB_LAZY_PARSE, a node's children and properties are only parsed the first
+ * time they're accessed (see expand_node()). Until then 'offset' is the index of the first token
+ * after the node's name in the struct block.
+ * When built with SMOLDTB_PROP_SLOTS, commonly used properties are also stored in 'known_props'
+ * (indexed by the KNOWN_PROP_* defines) as they're parsed, so they can be found without a search.
  */
 struct dtb_node_t
 {
-    dtb_node* parent;
-    dtb_node* sibling;
-    dtb_node* child;
-    dtb_prop* props;
-    const char* name;
+    node_ref parent;
+    node_ref sibling;
+    node_ref child;
+    prop_ref props;
+    node_ref subtree_end;
+    str_ref name;
+    uint32_t child_count;
+    uint32_t prop_count;
+    uint32_t sibling_index;
+#ifndef SMOLDTB_COMPACT_NODES
     bool fromMalloc;
+#endif
+#ifdef SMOLDTB_PROP_SLOTS
+    prop_ref known_props[KNOWN_PROP_COUNT];
+#endif
+#ifdef SMOLDTB_LAZY_PARSE
+    bool expanded;
+    uint32_t offset;
+#endif
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    uint32_t compat_count;
+    struct dtb_compat_match* compat;
+#endif
 };
 
-/* Similar to nodes, properties are stored a singly linked list. */
+/* Similar to nodes, properties are stored a singly linked list.
+ * Compact builds don't store the length, data is always preceded by a 'struct fdt_property'
+ * (see prop_length()), and data allocated by the write API has one added in front of it.
+ */
 struct dtb_prop_t
 {
-    dtb_node* node;
-    const char* name;
-    void* data;
-    dtb_prop* next;
+    node_ref node;
+    str_ref name;
+    data_ref data;
+    prop_ref next;
+#ifndef SMOLDTB_COMPACT_NODES
     uint32_t length;
     bool fromMalloc;
     bool dataFromMalloc;
+#endif
+};
+
+/* Parsed nodes and properties live in arenas: a singly linked list of pages, where each
+ * page holds a contiguous run of elements in the order they were allocated. Pages come from
+ * ops.malloc(), or are carved from the context's static buffer in static builds. While parsing, new pages are
+ * sized from how much of the struct block is left to parse, otherwise each page is as large as
+ * all previous pages combined. Either way a tree only needs a handful of pages.
+ */
+struct dtb_arena_page
+{
+    struct dtb_arena_page* next;
+    size_t size;
+    size_t capacity;
+    size_t used;
+};
+
+struct dtb_arena
+{
+    struct dtb_arena_page* head;
+    struct dtb_arena_page* tail;
+    size_t elem_size;
+    size_t total_capacity;
+    size_t count;
+};
+
+/* Entry in the phandle index, an open-addressing hash table keyed by phandle value.
+ * Unused slots have a NULL node.
+ */
+struct dtb_phandle_entry
+{
+    uint32_t handle;
+    node_ref node;
+};
+
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+/* The compatible index maps each distinct compatible string to the nodes that list it, in
+ * document order. Each node also points to its own run of match records (one per string in
+ * its compatible property), so continuing a search from a previous match only needs to look
+ * through the few records of that node.
+ */
+struct dtb_compat_match
+{
+    dtb_node* node;
+    struct dtb_compat_match* next;
+    const char* key; /* the string as stored in the index, so it can be compared by address */
+};
+
+struct dtb_compat_entry
+{
+    const char* str;
+    uint32_t len;
+    uint32_t hash;
+    struct dtb_compat_match* first;
+    struct dtb_compat_match* last;
+};
+#endif
+
+#ifdef SMOLDTB_PATH_INDEX
+/* The path index maps (parent, name) to a child node. Each child is stored under its full
+ * name, and under its name without the unit address if it has one.
+ */
+struct dtb_path_entry
+{
+    const dtb_node* parent;
+    dtb_node* child;
+    uint32_t hash;
+    uint32_t len;
+};
+#endif
+
+#ifdef SMOLDTB_RANGES_CACHE
+/* The ranges cache maps each bus node with a non-empty 'ranges' property to its decoded
+ * entries (as child address, parent address, size), sorted by child address. If any of a
+ * bus's ranges overlap they're kept in document order instead, since the first match wins.
+ * The entries of all buses live in one arena, and the table is sized once when it's built.
+ */
+struct dtb_ranges_entry
+{
+    const dtb_node* bus;
+    const dtb_triplet* ranges;
+    size_t count;
+    bool sorted;
+};
+#endif
+
+/* The layout of a nexus node's interrupt-map, and the mask applied to the child unit address
+ * and interrupt specifier (together the 'key') before they're compared to the map's entries.
+ */
+struct dtb_irq_nexus
+{
+    const dtb_node* node;
+    uint32_t addr_cells;
+    uint32_t spec_cells;
+    uint32_t mask[IRQ_KEY_CELLS];
+};
+
+/* A decoded interrupt-map entry, with the mask already applied to its key. When built with
+ * SMOLDTB_INTERRUPT_MAP_CACHE, the entries of every nexus are kept in an open-addressing hash
+ * table keyed by (nexus, key), and the nexuses in a second table keyed by node.
+ */
+struct dtb_irq_map_entry
+{
+    const dtb_node* nexus;
+    uint32_t hash;
+    uint32_t key[IRQ_KEY_CELLS];
+    dtb_node* parent;
+    uint32_t parent_addr_cells;
+    uint32_t parent_spec_cells;
+    uint32_t parent_addr[IRQ_ADDR_CELLS];
+    uint32_t parent_spec[SMOLDTB_MAX_INTERRUPT_CELLS];
 };
 
-/* Info for initializing the global state during init */
+/* A translated reg window, and the node it belongs to. 'order' is the node's position in the
+ * tree, and 'last' is inclusive so windows can reach the end of the address space.
+ */
+struct dtb_addr_window
+{
+    smoldtb_value base;
+    smoldtb_value last;
+    dtb_node* node;
+    size_t order;
+};
+
+#ifdef SMOLDTB_ADDRESS_INDEX
+/* The address index splits the address space into segments, each owned by the most specific
+ * node whose reg covers it (or none). Segment i covers addresses from its start until the
+ * start of segment i + 1, and the last segment runs to the end of the address space.
+ */
+struct dtb_addr_segment
+{
+    smoldtb_value start;
+    dtb_node* node;
+};
+#endif
+
+/* Info for initializing the parser state during init */
 struct dtb_init_info
 {
     const uint32_t* cells;
@@ -89,26 +344,160 @@ struct dtb_init_info
     size_t cell_count;
 };
 
-/* Global parser state */
-struct dtb_state
+#ifdef SMOLDTB_ENABLE_STREAMING
+/* A piece of the strings block that arrived in one chunk. 'tail_copy' is a copy of a string that
+ * starts at 'tail_offset' (in the strings block) and continues into the next piece, made the
+ * first time it's needed.
+ */
+struct dtb_stream_fragment
+{
+    size_t offset;
+    const char* data;
+    size_t length;
+    size_t tail_offset;
+    const char* tail_copy;
+};
+
+/* A tree that's being passed in pieces to dtb_feed(). The blob is consumed in order: 'pos' is
+ * the offset of the next byte, and 'step' is what it's expected to be part of. Anything split
+ * between chunks is copied, small fixed size items (like tokens) to 'scratch', and names and
+ * property data to the 'copies' arena, which lasts as long as the tree. Property names can't
+ * be found until the strings block arrives (usually last), so their offsets are kept in
+ * 'name_offsets' (in the same order as the properties) until then.
+ */
+struct dtb_stream
+{
+    uint32_t step;
+    size_t pos;
+    size_t skip;
+    const uint8_t* chunk;
+    size_t chunk_offset;
+    size_t chunk_end;
+    uint8_t* span;
+    size_t span_have;
+    uint64_t scratch[STREAM_SCRATCH_SIZE / sizeof(uint64_t)];
+
+    size_t total_size;
+    size_t resv_offset;
+    size_t struct_offset;
+    size_t struct_end;
+    size_t strings_offset;
+    size_t strings_end;
+    bool resv_done;
+    bool struct_done;
+
+    struct dtb_init_info info; /* only used for allocation estimates */
+    dtb_node* node;
+    dtb_node* last_child;
+    dtb_prop* last_prop;
+    dtb_node* last_root;
+    dtb_prop* prop;
+    struct dtb_arena copies;
+    struct dtb_arena name_offsets;
+    struct dtb_arena fragments;
+};
+#endif
+
+/* Parser state, there is one of these per context */
+struct dtb_ctx_t
 {
     dtb_node* root;
-    dtb_node** handle_lookup;
-    dtb_node* node_buff;
-    size_t node_alloc_head;
-    size_t node_alloc_max;
-    dtb_prop* prop_buff;
-    size_t prop_alloc_head;
-    size_t prop_alloc_max;
+    struct dtb_arena node_arena;
+    struct dtb_arena prop_arena;
+    struct dtb_phandle_entry* phandles;
+    size_t phandle_capacity;
+    size_t phandle_count;
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    struct dtb_arena compat_arena;
+    struct dtb_compat_entry* compat_table;
+    size_t compat_capacity;
+    size_t compat_count;
+    bool compat_valid;
+#endif
+#ifdef SMOLDTB_PATH_INDEX
+    struct dtb_path_entry* path_table;
+    size_t path_capacity;
+    size_t path_count;
+    bool path_valid;
+#endif
+#ifdef SMOLDTB_RANGES_CACHE
+    struct dtb_arena ranges_arena;
+    struct dtb_ranges_entry* ranges_table;
+    size_t ranges_capacity;
+    bool ranges_valid;
+#endif
+#ifdef SMOLDTB_ADDRESS_INDEX
+    struct dtb_addr_segment* addr_segments;
+    size_t addr_segment_capacity;
+    size_t addr_segment_count;
+    bool addr_valid;
+#endif
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+    struct dtb_irq_nexus* irq_nexus_table;
+    size_t irq_nexus_capacity;
+    struct dtb_irq_map_entry* irq_map_table;
+    size_t irq_map_capacity;
+    bool irq_map_valid;
+#endif
     uint64_t* resv_memory;
+    size_t resv_count;
+#ifdef SMOLDTB_COMPACT_NODES
+    uintptr_t blob_start;
+#endif
+    const char* strings;
+    size_t strings_size;
+#ifdef SMOLDTB_ENABLE_WRITE_API
+    bool subtree_ends_dirty;
+#endif
+#ifdef SMOLDTB_ENABLE_STREAMING
+    struct dtb_stream stream;
+#endif
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    uint8_t* buff;
+    size_t buff_head;
+#endif
+#ifdef SMOLDTB_LAZY_PARSE
+    struct dtb_init_info lazy_info;
+    bool lazy_complete;
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    bool compat_built;
+#endif
+#ifdef SMOLDTB_RANGES_CACHE
+    bool ranges_built;
+#endif
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+    bool irq_map_built;
+#endif
+#ifdef SMOLDTB_ADDRESS_INDEX
+    bool addr_built;
+#endif
+#endif
 
     dtb_ops ops;
 };
 
-struct dtb_state state;
-
 #ifdef SMOLDTB_STATIC_BUFFER_SIZE
     uint8_t big_buff[SMOLDTB_STATIC_BUFFER_SIZE];
+
+/* The default context uses big_buff, other contexts allocate a buffer of the same size. */
+static dtb_ctx default_ctx = { .buff = big_buff };
+#else
+static dtb_ctx default_ctx;
+#endif
+
+#ifdef SMOLDTB_ENABLE_CONTEXTS
+static SMOLDTB_THREAD_LOCAL dtb_ctx* current_state = &default_ctx;
+#define state (*current_state)
+
+static dtb_ctx* use_ctx(dtb_ctx* ctx)
+{
+    dtb_ctx* prev = current_state;
+    current_state = ctx != NULL ? ctx : &default_ctx;
+    return prev;
+}
+#else
+/* there's only the default context, so don't go through a pointer (or TLS) to reach it */
+#define state default_ctx
 #endif
 
 /* ---- Section: Utility Functions ---- */
@@ -145,6 +534,174 @@ static uint64_t be64(uint64_t input)
 #endif
 }
 
+#ifdef SMOLDTB_COMPACT_NODES
+static void* buff_ref_ptr(uint32_t ref)
+{
+    if (ref == 0)
+        return NULL;
+    return state.buff + ref;
+}
+
+static uint32_t buff_ptr_ref(const void* ptr)
+{
+    if (ptr == NULL)
+        return 0;
+    return (uint32_t)((const uint8_t*)ptr - state.buff);
+}
+
+/* Names and data can live in the blob, or in the static buffer if they were created by the write API. */
+static void* mem_ref_ptr(uint32_t ref)
+{
+    if (ref == 0)
+        return NULL;
+    if (ref & REF_IN_BUFF)
+        return state.buff + (ref & ~REF_IN_BUFF);
+    return (void*)(state.blob_start + ref);
+}
+
+static uint32_t mem_ptr_ref(const void* ptr)
+{
+    if (ptr == NULL)
+        return 0;
+
+    const uintptr_t addr = (uintptr_t)ptr;
+    const uintptr_t buff_base = (uintptr_t)state.buff;
+    if (addr >= buff_base && addr <= buff_base + SMOLDTB_STATIC_BUFFER_SIZE) //empty data can end the buffer
+        return (uint32_t)(addr - buff_base) | REF_IN_BUFF;
+    return (uint32_t)(addr - state.blob_start);
+}
+#endif
+
+static dtb_node* node_at(node_ref ref)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return buff_ref_ptr(ref);
+#else
+    return ref;
+#endif
+}
+
+static dtb_prop* prop_at(prop_ref ref)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return buff_ref_ptr(ref);
+#else
+    return ref;
+#endif
+}
+
+static node_ref ref_node(dtb_node* node)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return buff_ptr_ref(node);
+#else
+    return node;
+#endif
+}
+
+static prop_ref ref_prop(dtb_prop* prop)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return buff_ptr_ref(prop);
+#else
+    return prop;
+#endif
+}
+
+static str_ref ref_str(const char* str)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return mem_ptr_ref(str);
+#else
+    return str;
+#endif
+}
+
+static data_ref ref_data(void* data)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return mem_ptr_ref(data);
+#else
+    return data;
+#endif
+}
+
+static dtb_node* node_parent(const dtb_node* node)
+{
+    return node_at(node->parent);
+}
+
+static dtb_node* node_sibling(const dtb_node* node)
+{
+    return node_at(node->sibling);
+}
+
+static dtb_node* node_child(const dtb_node* node)
+{
+    return node_at(node->child);
+}
+
+static dtb_node* node_subtree_end(const dtb_node* node)
+{
+    return node_at(node->subtree_end);
+}
+
+static dtb_prop* node_props(const dtb_node* node)
+{
+    return prop_at(node->props);
+}
+
+static const char* node_name(const dtb_node* node)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return mem_ref_ptr(node->name);
+#else
+    return node->name;
+#endif
+}
+
+#if defined(SMOLDTB_ENABLE_WRITE_API) || defined(SMOLDTB_ENABLE_STREAMING)
+static dtb_node* prop_node(const dtb_prop* prop)
+{
+    return node_at(prop->node);
+}
+#endif
+
+static dtb_prop* prop_next(const dtb_prop* prop)
+{
+    return prop_at(prop->next);
+}
+
+static const char* prop_name(const dtb_prop* prop)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return mem_ref_ptr(prop->name);
+#else
+    return prop->name;
+#endif
+}
+
+static void* prop_data(const dtb_prop* prop)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return mem_ref_ptr(prop->data);
+#else
+    return prop->data;
+#endif
+}
+
+static size_t prop_length(const dtb_prop* prop)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    const struct fdt_property* header = prop_data(prop);
+    if (header == NULL)
+        return 0;
+    return be32(header[-1].length);
+#else
+    return prop->length;
+#endif
+}
+
 static size_t string_len(const char* str)
 {
     if (str == NULL)
@@ -192,11 +749,80 @@ static size_t string_find_char(const char* str, char target)
     return i;
 }
 
+/* Returns the length of a string, or max_len if there's no null terminator before then. Aligned
+ * words are checked for a zero byte all at once, so long strings are scanned a word at a time.
+ */
+static size_t string_len_bounded(const char* str, size_t max_len)
+{
+    const size_t ones = (size_t)-1 / 0xFF; //0x0101...
+    const size_t highs = ones << 7; //0x8080...
+
+    size_t i = 0;
+    while (i < max_len && ((uintptr_t)(str + i) % sizeof(size_t)) != 0)
+    {
+        if (str[i] == 0)
+            return i;
+        i++;
+    }
+
+    for (; i + sizeof(size_t) <= max_len; i += sizeof(size_t))
+    {
+        const size_t word = *(const size_t*)(str + i);
+        if (((word - ones) & ~word & highs) != 0)
+            break;
+    }
+
+    for (; i < max_len; i++)
+    {
+        if (str[i] == 0)
+            return i;
+    }
+    return max_len;
+}
+
+/* Steps through a property holding a list of strings, bounded by the property length rather
+ * than trusting the data to be null-terminated. Returns false once there are none left.
+ */
+static bool next_prop_string(const dtb_prop* prop, size_t* pos, const char** str, size_t* len)
+{
+    const char* data = prop_data(prop);
+    if (data == NULL || *pos >= prop_length(prop))
+        return false;
+
+    *str = data + *pos;
+    *len = string_len_bounded(*str, prop_length(prop) - *pos);
+    *pos += *len + 1;
+    return true;
+}
+
+/* Hashes a string of at most max_len bytes, and returns its length via len. */
+static uint32_t string_hash(const char* str, size_t max_len, size_t* len)
+{
+    uint32_t hash = 2166136261u; //FNV-1a
+    size_t i = 0;
+    for (; i < max_len && str[i] != 0; i++)
+    {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+    *len = i;
+    return hash;
+}
+
 static size_t dtb_align_up(size_t input, size_t alignment)
 {
     return ((input + alignment - 1) / alignment) * alignment;
 }
 
+#ifdef SMOLDTB_LAZY_PARSE
+static void expand_node(dtb_node* node);
+#else
+static void expand_node(dtb_node* node)
+{
+    (void)node;
+}
+#endif
+
 static void do_foreach_sibling(dtb_node* begin, int (*action)(dtb_node* node, void* opaque), void* opaque)
 {
     if (begin == NULL)
@@ -204,7 +830,7 @@ static void do_foreach_sibling(dtb_node* begin, int (*action)(dtb_node* node, vo
     if (action == NULL)
         return;
 
-    for (dtb_node* node = begin; node != NULL; node = node->sibling)
+    for (dtb_node* node = begin; node != NULL; node = node_sibling(node))
     {
         if (action(node, opaque) == SMOLDTB_FOREACH_ABORT)
             return;
@@ -215,1198 +841,5226 @@ static void do_foreach_prop(dtb_node* node, int (*action)(dtb_node* node, dtb_pr
 {
     if (node == NULL)
         return;
-    if (node->props == NULL)
+    expand_node(node);
+    if (node_props(node) == NULL)
         return;
     if (action == NULL)
         return;
 
-    for (dtb_prop* prop = node->props; prop != NULL; prop = prop->next)
+    dtb_prop* next = NULL;
+    for (dtb_prop* prop = node_props(node); prop != NULL; prop = next)
     {
+        next = prop_next(prop); /* action may destroy the property */
         if (action(node, prop, opaque) == SMOLDTB_FOREACH_ABORT)
             return;
     }
 }
 
+/* If there are more cells than fit in a smoldtb_value, only the least significant cells are kept */
 static smoldtb_value extract_cells(const uint32_t* cells, size_t count)
 {
     smoldtb_value value = 0;
     for (size_t i = 0; i < count; i++)
-        value |= (smoldtb_value)be32(cells[i]) << ((count - 1 - i) * 32);
+        value = (smoldtb_value)(((uint64_t)value << 32) | be32(cells[i]));
     return value;
 }
 
-static void* try_malloc(size_t count)
+/* Decodes 'count' values of 'cell_count' cells each, stored back to back. Values made
+ * of 1 or 2 cells (by far the most common) are converted in bulk, using SIMD if available.
+ */
+static void decode_cells(const uint32_t* cells, size_t cell_count, size_t count, smoldtb_value* vals)
 {
-    if (state.ops.malloc != NULL)
-        return state.ops.malloc(count);
+    size_t i = 0;
+    if (sizeof(smoldtb_value) == sizeof(uint64_t) && cell_count == 1)
+    {
+#if defined(CELLS_SIMD_SSSE3)
+        /* byte swap each cell and zero-extend it to 64 bits, 4 cells at a time */
+        const __m128i low = _mm_setr_epi8(3, 2, 1, 0, -1, -1, -1, -1, 7, 6, 5, 4, -1, -1, -1, -1);
+        const __m128i high = _mm_setr_epi8(11, 10, 9, 8, -1, -1, -1, -1, 15, 14, 13, 12, -1, -1, -1, -1);
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128i in = _mm_loadu_si128((const __m128i*)(cells + i));
+            _mm_storeu_si128((__m128i*)(vals + i), _mm_shuffle_epi8(in, low));
+            _mm_storeu_si128((__m128i*)(vals + i + 2), _mm_shuffle_epi8(in, high));
+        }
+#elif defined(CELLS_SIMD_NEON)
+        for (; i + 4 <= count; i += 4)
+        {
+            const uint32x4_t in = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8((const uint8_t*)(cells + i))));
+            vst1q_u64((uint64_t*)(vals + i), vmovl_u32(vget_low_u32(in)));
+            vst1q_u64((uint64_t*)(vals + i + 2), vmovl_u32(vget_high_u32(in)));
+        }
+#endif
+        for (; i < count; i++)
+            vals[i] = be32(cells[i]);
+        return;
+    }
 
-    LOG_ERROR("try_malloc() called but state.ops.malloc is NULL");
-    return NULL;
-}
+    if (sizeof(smoldtb_value) == sizeof(uint64_t) && cell_count == 2)
+    {
+        /* a pair of big-endian cells is a big-endian 64-bit value, so swap all 8 bytes */
+#if defined(CELLS_SIMD_SSSE3)
+        const __m128i swap = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        for (; i + 2 <= count; i += 2)
+        {
+            const __m128i in = _mm_loadu_si128((const __m128i*)(cells + i * 2));
+            _mm_storeu_si128((__m128i*)(vals + i), _mm_shuffle_epi8(in, swap));
+        }
+#elif defined(CELLS_SIMD_NEON)
+        for (; i + 2 <= count; i += 2)
+        {
+            const uint8x16_t in = vld1q_u8((const uint8_t*)(cells + i * 2));
+            vst1q_u64((uint64_t*)(vals + i), vreinterpretq_u64_u8(vrev64q_u8(in)));
+        }
+#endif
+        for (; i < count; i++)
+            vals[i] = extract_cells(cells + i * 2, 2);
+        return;
+    }
+
+    for (; i < count; i++)
+        vals[i] = extract_cells(cells + i * cell_count, cell_count);
+}
+
+static void* try_malloc(size_t count)
+{
+    if (state.ops.malloc != NULL)
+        return state.ops.malloc(count);
+
+    LOG_ERROR("try_malloc() called but state.ops.malloc is NULL");
+    return NULL;
+}
 
 static void try_free(void* ptr, size_t count)
 {
     if (state.ops.free != NULL)
+    {
         state.ops.free(ptr, count);
+        return;
+    }
 
     LOG_ERROR("try_free() called but state.ops.free is NULL");
 }
 
 /* ---- Section: Readonly-Mode Private Functions ---- */
 
-static dtb_node* alloc_node()
+/* Backing memory for the arenas. Static builds bump-allocate from state.buff, and can only
+ * release the most recent allocation, or everything at once (see free_buffers()).
+ */
+static void* buff_alloc(size_t length)
 {
-    if (state.node_alloc_head + 1 < state.node_alloc_max)
-        return &state.node_buff[state.node_alloc_head++];
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    const uintptr_t base = (uintptr_t)state.buff;
+    const uintptr_t begin = dtb_align_up(base + state.buff_head, BUFF_ALIGN);
+    if (begin + length > base + SMOLDTB_STATIC_BUFFER_SIZE)
+        return NULL;
 
-    LOG_ERROR("Not enough space for source dtb node.");
-    return NULL;
+    state.buff_head = (begin + length) - base;
+    return (void*)begin;
+#else
+    return try_malloc(length);
+#endif
 }
 
-static dtb_prop* alloc_prop()
+static void buff_free(void* ptr, size_t length)
 {
-    if (state.prop_alloc_head + 1 < state.prop_alloc_max)
-        return &state.prop_buff[state.prop_alloc_head++];
-
-    LOG_ERROR("Not enough space for source dtb property.");
-    return NULL;
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    const uintptr_t base = (uintptr_t)state.buff;
+    if ((uintptr_t)ptr + length == base + state.buff_head)
+        state.buff_head = (uintptr_t)ptr - base;
+#else
+    try_free(ptr, length);
+#endif
 }
 
-static void free_buffers()
+/* Returns how many more bytes buff_alloc() can provide, or -1 if unbounded. */
+static size_t buff_available()
 {
-#ifndef SMOLDTB_STATIC_BUFFER_SIZE
-    size_t buff_size = state.node_alloc_max * sizeof(dtb_node);
-    buff_size += state.prop_alloc_max * sizeof(dtb_prop);
-    buff_size += state.node_alloc_max * sizeof(void*);
-
-    try_free(state.node_buff, buff_size);
-    state.node_buff = NULL;
-    state.prop_buff = NULL;
-    state.handle_lookup = NULL;
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    const uintptr_t base = (uintptr_t)state.buff;
+    const uintptr_t begin = dtb_align_up(base + state.buff_head, BUFF_ALIGN);
+    if (begin >= base + SMOLDTB_STATIC_BUFFER_SIZE)
+        return 0;
+    return (base + SMOLDTB_STATIC_BUFFER_SIZE) - begin;
+#else
+    return -1ul;
 #endif
+}
 
-    state.node_alloc_head = state.node_alloc_max = 0;
-    state.prop_alloc_head = state.prop_alloc_max = 0;
+static void arena_init(struct dtb_arena* arena, size_t elem_size)
+{
+    arena->head = NULL;
+    arena->tail = NULL;
+    arena->elem_size = elem_size;
+    arena->total_capacity = 0;
+    arena->count = 0;
 }
 
-static bool alloc_buffers(struct dtb_init_info* init_info)
+static void arena_release(struct dtb_arena* arena)
 {
-    state.node_alloc_max = 0;
-    state.prop_alloc_max = 0;
-    for (size_t i = 0; i < init_info->cell_count; i++)
+    struct dtb_arena_page* page = arena->head;
+    while (page != NULL)
     {
-        if (be32(init_info->cells[i]) == FDT_BEGIN_NODE)
-            state.node_alloc_max++;
-        else if (be32(init_info->cells[i]) == FDT_PROP)
-            state.prop_alloc_max++;
+        struct dtb_arena_page* next = page->next;
+        buff_free(page, page->size);
+        page = next;
     }
 
-    size_t total_size = state.node_alloc_max * sizeof(dtb_node);
-    total_size += state.prop_alloc_max * sizeof(dtb_prop);
-    total_size += state.node_alloc_max * sizeof(void*); //we assume the worst case and that each node has a phandle prop
+    arena_init(arena, arena->elem_size);
+}
 
-#ifdef SMOLDTB_STATIC_BUFFER_SIZE
-    if (total_size >= SMOLDTB_STATIC_BUFFER_SIZE)
-    {
-        LOG_ERROR("Too much data for statically allocated buffer.");
+static void* arena_page_elem(struct dtb_arena* arena, struct dtb_arena_page* page, size_t index)
+{
+    return (uint8_t*)(page + 1) + index * arena->elem_size;
+}
+
+/* The hint is the number of elements the caller expects to allocate in the future, or 0 if unknown.
+ * The new page will always have space for at least min_count elements.
+ */
+static bool arena_grow(struct dtb_arena* arena, size_t hint, size_t min_count)
+{
+    size_t capacity = arena->total_capacity;
+    if (hint != 0)
+        capacity = hint + hint / 16;
+    if (capacity < arena->total_capacity / 4)
+        capacity = arena->total_capacity / 4;
+    if (capacity < ARENA_MIN_PAGE_ELEMS)
+        capacity = ARENA_MIN_PAGE_ELEMS;
+    if (capacity < min_count)
+        capacity = min_count;
+
+    const size_t header_size = sizeof(struct dtb_arena_page);
+    const size_t available = buff_available();
+    if (available < header_size + min_count * arena->elem_size)
         return false;
-    }
-    uint8_t* buffer = big_buff;
-#else
-    uint8_t* buffer = try_malloc(total_size);
-    if (buffer == NULL)
-    {
-        LOG_ERROR("Failed to allocate big buffer.");
+    if (header_size + capacity * arena->elem_size > available)
+        capacity = (available - header_size) / arena->elem_size; /* use whatever is left */
+
+    const size_t page_size = header_size + capacity * arena->elem_size;
+    struct dtb_arena_page* page = buff_alloc(page_size);
+    if (page == NULL)
         return false;
-    }
-#endif
 
-    for (size_t i = 0; i < total_size; i++)
-        buffer[i] = 0;
+    uint8_t* elems = arena_page_elem(arena, page, 0);
+    const size_t elems_size = capacity * arena->elem_size;
+    for (size_t i = 0; i < elems_size; i++)
+        elems[i] = 0;
+
+    page->next = NULL;
+    page->size = page_size;
+    page->capacity = capacity;
+    page->used = 0;
 
-    state.node_buff = (dtb_node*)buffer;
-    state.node_alloc_head = 0;
-    state.prop_buff = (dtb_prop*)&state.node_buff[state.node_alloc_max];
-    state.prop_alloc_head = 0;
-    state.handle_lookup = (dtb_node**)&state.prop_buff[state.prop_alloc_max];
+    if (arena->tail != NULL)
+        arena->tail->next = page;
+    else
+        arena->head = page;
+    arena->tail = page;
+    arena->total_capacity += capacity;
 
     return true;
 }
 
-/* This runs on every new property found, and handles some special cases for us. */
-static void check_for_special_prop(dtb_node* node, dtb_prop* prop)
+static bool arena_is_full(struct dtb_arena* arena)
 {
-    const char name0 = prop->name[0];
-    if (name0 != 'p' || name0 != 'l')
-        return; //short circuit to save processing
-
-    const size_t name_len = string_len(prop->name);
-
-    const char str_phandle[] = "phandle";
-    const size_t len_phandle = sizeof(str_phandle) - 1;
-    if (name_len == len_phandle && strings_eq(prop->name, str_phandle, name_len))
-    {
-        smoldtb_value handle;
-        dtb_read_prop_1(prop, 1, &handle);
-        state.handle_lookup[handle] = node;
-        return;
-    }
-
-    const char str_lhandle[] = "linux,phandle";
-    const size_t len_lhandle = sizeof(str_lhandle) - 1;
-    if (name_len == len_lhandle && strings_eq(prop->name, str_lhandle, name_len))
-    {
-        smoldtb_value handle;
-        dtb_read_prop_1(prop, 1, &handle);
-        state.handle_lookup[handle] = node;
-        return;
-    }
+    return arena->tail == NULL || arena->tail->used == arena->tail->capacity;
 }
 
-static dtb_prop* parse_prop(struct dtb_init_info* init_info, size_t* offset)
+/* Allocates count elements that are contiguous in memory. */
+static void* arena_alloc_run(struct dtb_arena* arena, size_t count, size_t hint)
 {
-    if (be32(init_info->cells[*offset]) != FDT_PROP)
-        return NULL;
-
-    (*offset)++;
-    dtb_prop* prop = alloc_prop();
-    if (prop == NULL)
+    if (arena->tail == NULL || arena->tail->capacity - arena->tail->used < count)
     {
-        LOG_ERROR("Property allocation failed");
-        return NULL;
+        if (!arena_grow(arena, hint, count))
+            return NULL;
     }
 
-    const struct fdt_property* fdtprop = (struct fdt_property*)(init_info->cells + *offset);
-    prop->name = (const char*)(init_info->strings + be32(fdtprop->name_offset));
-    prop->data = (void*)(init_info->cells + *offset + 2);
-    prop->length = be32(fdtprop->length);
-    prop->fromMalloc = false;
-    prop->dataFromMalloc = false;
-    (*offset) += (dtb_align_up(be32(fdtprop->length), 4) / 4) + 2;
-    
-    return prop;
+    void* elems = arena_page_elem(arena, arena->tail, arena->tail->used);
+    arena->tail->used += count;
+    arena->count += count;
+
+    return elems;
 }
 
-static dtb_node* parse_node(struct dtb_init_info* init_info, size_t* offset)
+static void* arena_alloc(struct dtb_arena* arena, size_t hint)
 {
-    if (be32(init_info->cells[*offset]) != FDT_BEGIN_NODE)
-        return NULL;
-
-    dtb_node* node = alloc_node(); 
-    if (node == NULL)
-    {
-        LOG_ERROR("Node allocation failed");
-        return NULL;
-    }
-    node->name = (const char*)(init_info->cells + (*offset) + 1);
-    node->fromMalloc = false;
-
-    const size_t name_len = string_len(node->name);
-    if (name_len == 0)
-        node->name = NULL;
-    *offset += (dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 1;
+    return arena_alloc_run(arena, 1, hint);
+}
 
-    while (*offset < init_info->cell_count)
-    {
-        const uint32_t test = be32(init_info->cells[*offset]);
-        if (test == FDT_END_NODE)
-        {
-            (*offset)++;
-            return node;
-        }
-        else if (test == FDT_BEGIN_NODE)
-        {
-            dtb_node* child = parse_node(init_info, offset);
-            if (child == NULL)
-                continue;
+/* Estimates how many more elements an arena will need, assuming the rest of the struct block
+ * contains nodes and properties at the same density as the part parsed so far.
+ */
+static size_t parse_estimate(struct dtb_arena* arena, struct dtb_init_info* init_info, size_t offset)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    /* nodes are parsed in whatever order they're accessed, so the estimate means nothing */
+    (void)arena;
+    (void)init_info;
+    (void)offset;
+    return 0;
+#else
+    if (offset == 0 || offset >= init_info->cell_count)
+        return 0;
 
-            child->sibling = node->child;
-            node->child = child;
-            child->parent = node;
-        }
-        else if (test == FDT_PROP)
-        {
-            dtb_prop* prop = parse_prop(init_info, offset);
-            if (prop == NULL)
-                continue;
+    const uint64_t remaining = init_info->cell_count - offset;
+    return (size_t)(((uint64_t)arena->count * remaining) / offset);
+#endif
+}
 
-            prop->next = node->props;
-            prop->node = node;
-            node->props = prop;
-            check_for_special_prop(node, prop);
-    }
-        else
-            (*offset)++;
-    }
+static dtb_node* alloc_node(struct dtb_init_info* init_info, size_t offset)
+{
+    size_t hint = 0;
+    if (arena_is_full(&state.node_arena))
+        hint = parse_estimate(&state.node_arena, init_info, offset);
+    dtb_node* node = arena_alloc(&state.node_arena, hint);
+    if (node != NULL)
+        return node;
 
-    LOG_ERROR("Node is missing terminating tag.");
+    LOG_ERROR("Not enough space for source dtb node.");
     return NULL;
 }
 
-/* ---- Section: Readonly-Mode Public API ---- */
-
-size_t dtb_query_total_size(uintptr_t fdt_start)
+static dtb_prop* alloc_prop(struct dtb_init_info* init_info, size_t offset)
 {
-    if (fdt_start == 0)
-        return 0;
-
-    struct fdt_header* header = (struct fdt_header*)fdt_start;
-    if (be32(header->magic) != FDT_MAGIC)
-        return 0;
+    size_t hint = 0;
+    if (arena_is_full(&state.prop_arena))
+        hint = parse_estimate(&state.prop_arena, init_info, offset);
+    dtb_prop* prop = arena_alloc(&state.prop_arena, hint);
+    if (prop != NULL)
+        return prop;
 
-    return be32(header->total_size);
+    LOG_ERROR("Not enough space for source dtb property.");
+    return NULL;
 }
 
-bool dtb_init(uintptr_t start, dtb_ops ops)
+static void free_buffers()
 {
-    state.ops = ops;
-
-#if !defined(SMOLDTB_STATIC_BUFFER_SIZE)
-    if (state.ops.malloc == NULL)
-    {
-        LOG_ERROR("smoldtb has been compiled without an internal static buffer, but not passed a malloc() function.");
-        return false;
-    }
+    arena_release(&state.node_arena);
+    arena_release(&state.prop_arena);
+    if (state.phandles != NULL)
+        buff_free(state.phandles, state.phandle_capacity * sizeof(struct dtb_phandle_entry));
+    state.phandles = NULL;
+    state.phandle_capacity = 0;
+    state.phandle_count = 0;
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    arena_release(&state.compat_arena);
+    if (state.compat_table != NULL)
+        buff_free(state.compat_table, state.compat_capacity * sizeof(struct dtb_compat_entry));
+    state.compat_table = NULL;
+    state.compat_capacity = 0;
+    state.compat_count = 0;
+    state.compat_valid = false;
+#ifdef SMOLDTB_LAZY_PARSE
+    state.compat_built = false;
+#endif
+#endif
+#ifdef SMOLDTB_PATH_INDEX
+    if (state.path_table != NULL)
+        buff_free(state.path_table, state.path_capacity * sizeof(struct dtb_path_entry));
+    state.path_table = NULL;
+    state.path_capacity = 0;
+    state.path_count = 0;
+    state.path_valid = false;
+#endif
+#ifdef SMOLDTB_RANGES_CACHE
+    arena_release(&state.ranges_arena);
+    if (state.ranges_table != NULL)
+        buff_free(state.ranges_table, state.ranges_capacity * sizeof(struct dtb_ranges_entry));
+    state.ranges_table = NULL;
+    state.ranges_capacity = 0;
+    state.ranges_valid = false;
+#ifdef SMOLDTB_LAZY_PARSE
+    state.ranges_built = false;
+#endif
+#endif
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+    if (state.irq_nexus_table != NULL)
+        buff_free(state.irq_nexus_table, state.irq_nexus_capacity * sizeof(struct dtb_irq_nexus));
+    if (state.irq_map_table != NULL)
+        buff_free(state.irq_map_table, state.irq_map_capacity * sizeof(struct dtb_irq_map_entry));
+    state.irq_nexus_table = NULL;
+    state.irq_nexus_capacity = 0;
+    state.irq_map_table = NULL;
+    state.irq_map_capacity = 0;
+    state.irq_map_valid = false;
+#ifdef SMOLDTB_LAZY_PARSE
+    state.irq_map_built = false;
+#endif
+#endif
+#ifdef SMOLDTB_ADDRESS_INDEX
+    if (state.addr_segments != NULL)
+        buff_free(state.addr_segments, state.addr_segment_capacity * sizeof(struct dtb_addr_segment));
+    state.addr_segments = NULL;
+    state.addr_segment_capacity = 0;
+    state.addr_segment_count = 0;
+    state.addr_valid = false;
+#ifdef SMOLDTB_LAZY_PARSE
+    state.addr_built = false;
+#endif
+#endif
+#ifdef SMOLDTB_ENABLE_STREAMING
+    /* names and data split between chunks live here, so they're only freed with the tree */
+    arena_release(&state.stream.copies);
+    arena_release(&state.stream.name_offsets);
+    arena_release(&state.stream.fragments);
+    state.stream.step = STREAM_STEP_IDLE;
+#endif
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    state.buff_head = 0;
 #endif
+}
 
-    struct dtb_init_info init_info;
-    if (start == SMOLDTB_INIT_EMPTY_TREE)
-    {
-        state.root = NULL;
-        return true;
-    }
+static size_t phandle_slot(uint32_t handle)
+{
+    /* phandles are often small sequential integers, so mix the bits before masking */
+    const uint32_t hash = handle * 0x9E3779B1u;
+    return (size_t)(hash ^ (hash >> 16)) & (state.phandle_capacity - 1);
+}
 
-    struct fdt_header* header = (struct fdt_header*)start;
-    if (be32(header->magic) != FDT_MAGIC)
-    {
-        LOG_ERROR("FDT has incorrect magic number.");
+/* Grows the table so it can hold count entries without going over half full. */
+static bool phandle_index_grow(size_t count)
+{
+    size_t new_capacity = state.phandle_capacity * 2;
+    if (new_capacity < PHANDLE_MIN_CAPACITY)
+        new_capacity = PHANDLE_MIN_CAPACITY;
+    while (count * 2 > new_capacity)
+        new_capacity *= 2;
+
+    const size_t new_size = new_capacity * sizeof(struct dtb_phandle_entry);
+    struct dtb_phandle_entry* new_table = buff_alloc(new_size);
+    if (new_table == NULL)
         return false;
-    }
-
-    state.resv_memory = (uint64_t*)(start + be32(header->offset_memmap_rsvd));
-    init_info.cells = (const uint32_t*)(start + be32(header->offset_structs));
-    init_info.cell_count = be32(header->size_structs) / sizeof(uint32_t);
-    init_info.strings = (const char*)(start + be32(header->offset_strings));
+    for (size_t i = 0; i < new_capacity; i++)
+        new_table[i].node = ref_node(NULL);
 
-    if (state.node_buff != NULL)
-        free_buffers();
-    if (!alloc_buffers(&init_info))
-    {
-        LOG_ERROR("failed to allocate readonly buffer");
-        return false;
-    }
+    struct dtb_phandle_entry* old_table = state.phandles;
+    const size_t old_capacity = state.phandle_capacity;
+    state.phandles = new_table;
+    state.phandle_capacity = new_capacity;
 
-    for (size_t i = 0; i < init_info.cell_count; i++)
+    for (size_t i = 0; i < old_capacity; i++)
     {
-        if (be32(init_info.cells[i]) != FDT_BEGIN_NODE)
+        if (node_at(old_table[i].node) == NULL)
             continue;
 
-        dtb_node* sub_root = parse_node(&init_info, &i);
-        if (sub_root == NULL)
-            continue;
-        sub_root->sibling = state.root;
-        state.root = sub_root;
+        size_t slot = phandle_slot(old_table[i].handle);
+        while (node_at(new_table[slot].node) != NULL)
+            slot = (slot + 1) & (new_capacity - 1);
+        new_table[slot] = old_table[i];
     }
 
+    if (old_table != NULL)
+        buff_free(old_table, old_capacity * sizeof(struct dtb_phandle_entry));
     return true;
 }
 
-dtb_node* dtb_find_compatible(dtb_node* start, const char* str)
+static bool phandle_index_insert(uint32_t handle, dtb_node* node)
 {
-    size_t begin_index = 0;
-    if (start != NULL)
+    if ((state.phandle_count + 1) * 2 > state.phandle_capacity && !phandle_index_grow(state.phandle_count + 1))
     {
-        const uintptr_t offset = (uintptr_t)start - (uintptr_t)state.node_buff;
-        begin_index = offset / sizeof(dtb_node);
-        begin_index++; //we want to start searching AFTER this node.
+        LOG_ERROR("Not enough space for phandle index.");
+        return false;
     }
 
-    for (size_t i = begin_index; i < state.node_alloc_head; i++)
+    size_t slot = phandle_slot(handle);
+    while (node_at(state.phandles[slot].node) != NULL)
     {
-        dtb_node* node = &state.node_buff[i];
-        if (dtb_is_compatible(node, str))
-            return node;
+        if (state.phandles[slot].handle == handle)
+            return true; /* phandles should be unique, keep the first node to claim it */
+        slot = (slot + 1) & (state.phandle_capacity - 1);
     }
 
-    return NULL;
-} 
+    state.phandles[slot].handle = handle;
+    state.phandles[slot].node = ref_node(node);
+    state.phandle_count++;
+    return true;
+}
 
-dtb_node* dtb_find_phandle(unsigned handle)
+static dtb_node* phandle_index_find(uint32_t handle)
 {
-    if (handle < state.node_alloc_max)
-        return state.handle_lookup[handle];
+    if (state.phandle_count == 0)
+        return NULL;
+
+    size_t slot = phandle_slot(handle);
+    while (node_at(state.phandles[slot].node) != NULL)
+    {
+        if (state.phandles[slot].handle == handle)
+            return node_at(state.phandles[slot].node);
+        slot = (slot + 1) & (state.phandle_capacity - 1);
+    }
 
     return NULL;
 }
 
-static dtb_node* find_child_internal(dtb_node* start, const char* name, size_t name_bounds)
+#ifdef SMOLDTB_PROP_SLOTS
+/* Returns which slot a property name belongs in, or KNOWN_PROP_COUNT if it isn't cached.
+ * Most names are rejected by their first character or two, without a full comparison.
+ */
+static size_t known_prop_slot(const char* name)
 {
-    dtb_node* scan = start->child;
-    while (scan != NULL)
+    switch (name[0])
     {
-        size_t child_name_len = string_find_char(scan->name, '@');
-        if (child_name_len == -1ul)
-            child_name_len = string_len(scan->name);
-
-        if (child_name_len == name_bounds && strings_eq(scan->name, name, name_bounds))
-            return scan;
-
-        scan = scan->sibling;
+    case 'c':
+        if (strings_eq(name, "compatible", sizeof("compatible")))
+            return KNOWN_PROP_COMPATIBLE;
+        break;
+    case 'r':
+        if (name[1] == 'e' && strings_eq(name, "reg", sizeof("reg")))
+            return KNOWN_PROP_REG;
+        if (name[1] == 'a' && strings_eq(name, "ranges", sizeof("ranges")))
+            return KNOWN_PROP_RANGES;
+        break;
+    case 's':
+        if (strings_eq(name, "status", sizeof("status")))
+            return KNOWN_PROP_STATUS;
+        break;
+    case 'p':
+        if (strings_eq(name, "phandle", sizeof("phandle")))
+            return KNOWN_PROP_PHANDLE;
+        break;
+    case '#':
+        if (name[1] == 'a' && strings_eq(name, "#address-cells", sizeof("#address-cells")))
+            return KNOWN_PROP_ADDR_CELLS;
+        if (name[1] == 's' && strings_eq(name, "#size-cells", sizeof("#size-cells")))
+            return KNOWN_PROP_SIZE_CELLS;
+        break;
+    case 'i':
+        if (strings_eq(name, "interrupts", sizeof("interrupts")))
+            return KNOWN_PROP_INTERRUPTS;
+        break;
     }
 
-    return NULL;
+    return KNOWN_PROP_COUNT;
 }
+#endif
 
-dtb_node* dtb_find(const char* name)
+static bool is_phandle_name(const char* name)
 {
-    size_t seg_len;
-    dtb_node* scan = state.root;
-    while (scan != NULL)
-    {
-        while (name[0] == '/')
-            name++;
+    const char name0 = name[0];
+    if (name0 != 'p' && name0 != 'l')
+        return false; //short circuit to save processing
 
-        seg_len = string_find_char(name, '/');
-        if (seg_len == -1ul)
-            seg_len = string_len(name);
-        if (seg_len == 0)
-            return scan;
+    const size_t name_len = string_len(name);
 
-        scan = find_child_internal(scan, name, seg_len);
-        name += seg_len;
-    }
+    const char str_phandle[] = "phandle";
+    const size_t len_phandle = sizeof(str_phandle) - 1;
+    if (name_len == len_phandle && strings_eq(name, str_phandle, name_len))
+        return true;
 
-    return NULL;
-} 
+    const char str_lhandle[] = "linux,phandle";
+    const size_t len_lhandle = sizeof(str_lhandle) - 1;
+    if (name_len == len_lhandle && strings_eq(name, str_lhandle, name_len))
+        return true;
 
-dtb_node* dtb_find_child(dtb_node* start, const char* name)
-{
-    if (start == NULL)
-        return NULL;
+    return false;
+}
 
-    return find_child_internal(start, name, string_len(name));
+static bool is_phandle_prop(dtb_prop* prop)
+{
+    return is_phandle_name(prop_name(prop));
 }
 
-dtb_prop* dtb_find_prop(dtb_node* node, const char* name)
+static bool read_phandle(dtb_prop* prop, uint32_t* handle)
 {
-    if (node == NULL)
-        return NULL;
+    if (prop_data(prop) == NULL || prop_length(prop) < FDT_CELL_SIZE)
+        return false;
 
-    const size_t name_len = string_len(name);
-    dtb_prop* prop = node->props;
-    while (prop)
+    *handle = be32(*(const uint32_t*)prop_data(prop));
+    return true;
+}
+
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+/* Returns the slot holding str, or the empty slot it would be inserted into. */
+static size_t compat_slot(const char* str, size_t len, uint32_t hash)
+{
+    const size_t mask = state.compat_capacity - 1;
+    size_t slot = hash & mask;
+    while (state.compat_table[slot].str != NULL)
     {
-        const size_t prop_name_len = string_len(prop->name);
-        if (prop_name_len == name_len && strings_eq(prop->name, name, prop_name_len))
-            return prop;
-        prop = prop->next;
+        const struct dtb_compat_entry* entry = &state.compat_table[slot];
+        if (entry->hash == hash && entry->len == len && strings_eq(entry->str, str, len))
+            return slot;
+        slot = (slot + 1) & mask;
     }
-
-    return NULL;
+    return slot;
 }
 
-dtb_node* dtb_get_sibling(dtb_node* node)
+static bool compat_index_grow(size_t count)
 {
-    if (node == NULL || node->sibling == NULL)
-        return NULL;
-    return node->sibling;
+    size_t new_capacity = state.compat_capacity * 2;
+    if (new_capacity < COMPAT_MIN_CAPACITY)
+        new_capacity = COMPAT_MIN_CAPACITY;
+    while (count * 2 > new_capacity)
+        new_capacity *= 2;
+
+    const size_t new_size = new_capacity * sizeof(struct dtb_compat_entry);
+    struct dtb_compat_entry* new_table = buff_alloc(new_size);
+    if (new_table == NULL)
+        return false;
+    for (size_t i = 0; i < new_capacity; i++)
+        new_table[i].str = NULL;
+
+    struct dtb_compat_entry* old_table = state.compat_table;
+    const size_t old_capacity = state.compat_capacity;
+    state.compat_table = new_table;
+    state.compat_capacity = new_capacity;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_table[i].str == NULL)
+            continue;
+
+        size_t slot = old_table[i].hash & (new_capacity - 1);
+        while (new_table[slot].str != NULL)
+            slot = (slot + 1) & (new_capacity - 1);
+        new_table[slot] = old_table[i];
+    }
+
+    if (old_table != NULL)
+        buff_free(old_table, old_capacity * sizeof(struct dtb_compat_entry));
+    return true;
 }
 
-dtb_node* dtb_get_child(dtb_node* node)
+/* Counts the strings in a string list property. */
+static size_t count_strings(const char* data, size_t length)
 {
-    if (node == NULL)
-        return NULL;
-    return node->child;
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++)
+        count += (data[i] == 0);
+    if (length != 0 && data[length - 1] != 0)
+        count++; //last string isn't null-terminated
+    return count;
 }
 
-dtb_node* dtb_get_parent(dtb_node* node)
+#if !defined(SMOLDTB_LAZY_PARSE) || defined(SMOLDTB_ENABLE_WRITE_API)
+static bool is_compatible_prop(dtb_prop* prop)
 {
-    if (node == NULL)
-        return NULL;
-    return node->parent;
+    return prop_name(prop)[0] == 'c' && strings_eq(prop_name(prop), "compatible", sizeof("compatible"));
 }
+#endif
 
-
-dtb_prop* dtb_get_prop(dtb_node* node, size_t index)
+/* Appends a node to the match list of each string in its compatible property. Nodes must be
+ * added in document order so the lists are in the same order a linear search would return.
+ */
+static bool compat_index_add(dtb_node* node, dtb_prop* prop)
 {
-    if (node == NULL)
-        return NULL;
-    
-    dtb_prop* prop = node->props;
-    while (prop != NULL)
+    /* each string gets a match record, count them so the records can be allocated together */
+    const char* data = prop_data(prop);
+    const size_t length = prop_length(prop);
+    const size_t count = count_strings(data, length);
+    if (count == 0)
+        return true;
+
+    struct dtb_compat_match* matches = arena_alloc_run(&state.compat_arena, count, state.node_arena.total_capacity);
+    if (matches == NULL)
+        return false;
+    node->compat = matches;
+    node->compat_count = count;
+
+    size_t begin = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        if (index == 0)
-            return prop;
+        matches[i].node = node;
+        matches[i].next = NULL;
 
-        index--;
-        prop = prop->next;
-    }
+        const char* str = data + begin;
+        size_t len = 0;
+        const uint32_t hash = string_hash(str, length - begin, &len);
+        begin += len + 1;
 
-    return NULL;
-}
+        if ((state.compat_count + 1) * 2 > state.compat_capacity && !compat_index_grow(state.compat_count + 1))
+            return false;
 
-static size_t get_cells_helper(dtb_node* node, const char* prop_name, size_t orDefault)
-{
-    if (node == NULL)
-        return orDefault;
+        struct dtb_compat_entry* entry = &state.compat_table[compat_slot(str, len, hash)];
+        if (entry->str == NULL)
+        {
+            entry->str = str;
+            entry->len = len;
+            entry->hash = hash;
+            entry->first = &matches[i];
+            entry->last = &matches[i];
+            state.compat_count++;
+            matches[i].key = str;
+            continue;
+        }
+        matches[i].key = entry->str;
+        if (entry->last->node == node)
+            continue; //string is listed twice by this node, only link the first occurrence
 
-    dtb_prop* prop = dtb_find_prop(node, prop_name);
-    if (prop == NULL)
-        return orDefault;
+        entry->last->next = &matches[i];
+        entry->last = &matches[i];
+    }
 
-    smoldtb_value ret_value;
-    if (dtb_read_prop_1(prop, 1, &ret_value) == 1)
-        return (size_t)ret_value;
-    return orDefault;
+    return true;
 }
+#endif
 
-size_t dtb_get_addr_cells_of(dtb_node* node)
+/* This runs on every new property found, and handles some special cases for us. */
+static bool check_for_special_prop(dtb_node* node, dtb_prop* prop)
 {
-    return get_cells_helper(node, "#address-cells", 2);
-}
+#ifdef SMOLDTB_PROP_SLOTS
+    /* if a name is repeated, keep the first one like a search of the list would */
+    const size_t slot = known_prop_slot(prop_name(prop));
+    if (slot != KNOWN_PROP_COUNT && prop_at(node->known_props[slot]) == NULL)
+        node->known_props[slot] = ref_prop(prop);
+#endif
 
-size_t dtb_get_size_cells_of(dtb_node* node)
-{
-    return get_cells_helper(node, "#size-cells", 1);
-}
 
-size_t dtb_get_addr_cells_for(dtb_node* node)
-{
-    if (node == NULL)
-        return 2;
-    return get_cells_helper(node->parent, "#address-cells", 2);
+    uint32_t handle;
+    if (is_phandle_prop(prop) && read_phandle(prop, &handle))
+        return phandle_index_insert(handle, node);
+
+#if defined(SMOLDTB_COMPATIBLE_INDEX) && !defined(SMOLDTB_LAZY_PARSE)
+    /* Nodes are parsed in document order, so the index can be filled in as we go. */
+    if (state.compat_valid && is_compatible_prop(prop) && !compat_index_add(node, prop))
+    {
+        LOG_ERROR("Not enough space for compatible index.");
+        state.compat_valid = false;
+    }
+#endif
+
+    return true;
 }
 
-size_t dtb_get_size_cells_for(dtb_node* node)
+#ifdef SMOLDTB_PATH_INDEX
+static uint32_t path_hash(const dtb_node* parent, uint32_t name_hash)
 {
-    if (node == NULL)
-        return 1;
-    return get_cells_helper(node->parent, "#size-cells", 1);
+    const uint32_t mixed = (uint32_t)((uintptr_t)parent >> 4) * 0x9E3779B1u;
+    return name_hash ^ mixed ^ (mixed >> 16);
 }
 
-bool dtb_is_compatible(dtb_node* node, const char* str)
+/* Returns the slot holding this child name, or the empty slot it would be inserted into. */
+static size_t path_slot(const dtb_node* parent, const char* name, size_t len, uint32_t hash)
 {
-    if (node == NULL || str == NULL)
-        return false;
-
-    dtb_prop* compat_prop = dtb_find_prop(node, "compatible");
-    if (compat_prop == NULL)
-        return false;
-
-    const size_t str_len = string_len(str);
-    for (size_t i = 0; ; i++)
+    const size_t mask = state.path_capacity - 1;
+    size_t slot = hash & mask;
+    while (state.path_table[slot].child != NULL)
     {
-        const char* check_str = dtb_read_prop_string(compat_prop, i);
-        if (check_str == NULL)
-            return false;
-        if (strings_eq(check_str, str, str_len))
-            return true;
+        const struct dtb_path_entry* entry = &state.path_table[slot];
+        if (entry->hash == hash && entry->parent == parent && entry->len == len
+            && strings_eq(node_name(entry->child), name, len))
+            return slot;
+        slot = (slot + 1) & mask;
     }
+    return slot;
 }
 
-bool dtb_stat_node(dtb_node* node, dtb_node_stat* stat)
+static bool path_index_grow(size_t count)
 {
-    if (node == NULL || stat == NULL)
+    size_t new_capacity = state.path_capacity * 2;
+    if (new_capacity < PATH_MIN_CAPACITY)
+        new_capacity = PATH_MIN_CAPACITY;
+    while (count * 2 > new_capacity)
+        new_capacity *= 2;
+
+    const size_t new_size = new_capacity * sizeof(struct dtb_path_entry);
+    struct dtb_path_entry* new_table = buff_alloc(new_size);
+    if (new_table == NULL)
         return false;
+    for (size_t i = 0; i < new_capacity; i++)
+        new_table[i].child = NULL;
 
-    stat->name = node->name;
-    if (node == state.root)
-        stat->name = ROOT_NODE_STR;
-
-    stat->prop_count = 0;
-    dtb_prop* prop = node->props;
-    while (prop != NULL)
-    {
-        prop = prop->next;
-        stat->prop_count++;
-    }
+    struct dtb_path_entry* old_table = state.path_table;
+    const size_t old_capacity = state.path_capacity;
+    state.path_table = new_table;
+    state.path_capacity = new_capacity;
 
-    stat->child_count = 0;
-    dtb_node* child = node->child;
-    while (child != NULL)
+    for (size_t i = 0; i < old_capacity; i++)
     {
-        child = child->sibling;
-        stat->child_count++;
-    }
+        if (old_table[i].child == NULL)
+            continue;
 
-    stat->sibling_count = 0;
-    if (node->parent)
-    {
-        dtb_node* prime = node->parent->child;
-        while (prime != NULL)
-        {
-            prime = prime->sibling;
-            stat->sibling_count++;
-        }
+        size_t slot = old_table[i].hash & (new_capacity - 1);
+        while (new_table[slot].child != NULL)
+            slot = (slot + 1) & (new_capacity - 1);
+        new_table[slot] = old_table[i];
     }
 
+    if (old_table != NULL)
+        buff_free(old_table, old_capacity * sizeof(struct dtb_path_entry));
     return true;
 }
 
-bool dtb_stat_prop(dtb_prop* prop, dtb_prop_stat* stat)
+static bool path_index_insert(dtb_node* child, size_t len, uint32_t name_hash)
 {
-    if (prop == NULL || stat == NULL)
+    if ((state.path_count + 1) * 2 > state.path_capacity && !path_index_grow(state.path_count + 1))
         return false;
 
-    stat->name = prop->name;
-    stat->data = prop->data;
-    stat->data_len = prop->length;
+    const uint32_t hash = path_hash(node_parent(child), name_hash);
+    const size_t slot = path_slot(node_parent(child), node_name(child), len, hash);
+    if (state.path_table[slot].child != NULL)
+        return true; /* keep the first child in the list, like a linear search would */
+
+    state.path_table[slot].parent = node_parent(child);
+    state.path_table[slot].child = child;
+    state.path_table[slot].hash = hash;
+    state.path_table[slot].len = len;
+    state.path_count++;
     return true;
 }
 
-size_t dtb_read_resv_memory(size_t entry_count, dtb_reserved_memory* vals)
+/* Runs once a node's list of children is complete. */
+static void path_index_add_children(dtb_node* node)
 {
-    size_t total_count = 0;
-    while (be64(state.resv_memory[total_count * 2] != 0))
-        total_count++;
-
-    if (entry_count == 0 || vals == NULL)
-        return total_count;
+    if (!state.path_valid)
+        return;
 
-    if (total_count < entry_count)
-        entry_count = total_count;
-    for (size_t i = 0; i < entry_count; i++)
+    for (dtb_node* child = node_child(node); child != NULL; child = node_sibling(child))
     {
-        vals[i].base = be64(state.resv_memory[i * 2]);
-        vals[i].length = be64(state.resv_memory[i * 2]);
-    }
+        size_t full_len;
+        const uint32_t full_hash = string_hash(node_name(child), -1ul, &full_len);
+        bool success = path_index_insert(child, full_len, full_hash);
 
-    return entry_count;
-}
+        const size_t base_len = string_find_char(node_name(child), '@');
+        if (success && base_len != -1ul)
+        {
+            size_t unused;
+            success = path_index_insert(child, base_len, string_hash(node_name(child), base_len, &unused));
+        }
 
-const char* dtb_read_prop_string(dtb_prop* prop, size_t index)
-{
-    if (prop == NULL)
-        return NULL;
-    
-    const uint8_t* name = (const uint8_t*)prop->data;
-    size_t curr_index = 0;
-    for (size_t scan = 0; scan < prop->length * 4; scan++)
-    {
-        if (name[scan] == 0)
+        if (!success)
         {
-            curr_index++;
-            continue;
+            LOG_ERROR("Not enough space for path index.");
+            state.path_valid = false;
+            return;
         }
-        if (curr_index == index)
-            return (const char*)&name[scan];
     }
-
-    return NULL;
 }
+#endif
 
-size_t dtb_read_prop_1(dtb_prop* prop, size_t cell_count, smoldtb_value* vals)
+/* Finds one of the KNOWN_PROP_* properties, name must be the matching property name. */
+static dtb_prop* find_known_prop(dtb_node* node, size_t slot, const char* name)
 {
-    if (prop == NULL || cell_count == 0)
-        return 0;
-    
-    const uint32_t* prop_cells = prop->data;
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop_cells - 2);
-    const size_t count = be32(fdtprop->length) / (cell_count * FDT_CELL_SIZE);
-    if (vals == NULL)
-        return count;
-
-    for (size_t i = 0; i < count; i++)
-    {
-        const uint32_t* base = prop_cells + i * cell_count;
-        vals[i] = extract_cells(base, cell_count);
-    }
-
-    return count;
+#ifdef SMOLDTB_PROP_SLOTS
+    (void)name;
+    if (node == NULL)
+        return NULL;
+    expand_node(node);
+    return prop_at(node->known_props[slot]);
+#else
+    (void)slot;
+    return dtb_find_prop(node, name);
+#endif
 }
 
-size_t dtb_read_prop_2(dtb_prop* prop, dtb_pair layout, dtb_pair* vals)
+/* Returns the number of cells used by a null-terminated name in the struct block. Rather than
+ * checking each byte, this looks for the first cell containing a zero byte.
+ */
+static size_t name_cell_count(const uint32_t* cells, size_t offset, size_t cell_count)
 {
-    if (prop == NULL || layout.a == 0 || layout.b == 0)
-        return 0;
-    
-    const uint32_t* prop_cells = prop->data;
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop_cells - 2);
-    const size_t count = be32(fdtprop->length) / ((layout.a + layout.b) * FDT_CELL_SIZE);
-    if (vals == NULL)
-        return count;
-
-    for (size_t i = 0; i < count; i++)
+    size_t count = 0;
+    while (offset + count < cell_count)
     {
-        const uint32_t* base = prop_cells + i * (layout.a + layout.b);
-        vals[i].a = extract_cells(base, layout.a);
-        vals[i].b = extract_cells(base + layout.a, layout.b);
+        const uint32_t test = cells[offset + count++];
+        if (((test - 0x01010101) & ~test & 0x80808080) != 0)
+            break;
     }
     return count;
 }
 
-size_t dtb_read_prop_3(dtb_prop* prop, dtb_triplet layout, dtb_triplet* vals)
+/* A decoded token from the struct block. For FDT_BEGIN_NODE 'name' is the node's name, and for
+ * FDT_PROP it's the property's name, along with its data and length. 'next' is the offset of the
+ * following token. A property that doesn't fit in the struct block is decoded as an FDT_NOP.
+ */
+struct dtb_token
 {
-    if (prop == NULL || layout.a == 0 || layout.b == 0 || layout.c == 0)
-        return 0;
-
-    const uint32_t* prop_cells = prop->data;
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop_cells - 2);
-    const size_t stride = layout.a + layout.b + layout.c;
-    const size_t count = be32(fdtprop->length) / (stride * FDT_CELL_SIZE);
-    if (vals == NULL)
-        return count;
+    uint32_t type;
+    const char* name;
+    const void* data;
+    size_t length;
+    size_t next;
+};
 
-    for (size_t i = 0; i < count; i++)
+static void read_token(const struct dtb_init_info* init_info, size_t offset, struct dtb_token* token)
+{
+    token->type = be32(init_info->cells[offset]);
+    token->next = offset + 1;
+    if (token->type == FDT_BEGIN_NODE)
     {
-        const uint32_t* base = prop_cells + i * stride;
-        vals[i].a = extract_cells(base, layout.a);
-        vals[i].b = extract_cells(base + layout.a, layout.b);
-        vals[i].c = extract_cells(base + layout.a + layout.b, layout.c);
+        token->name = (const char*)(init_info->cells + offset + 1);
+        token->next += name_cell_count(init_info->cells, offset + 1, init_info->cell_count);
     }
-    return count;
+    else if (token->type == FDT_PROP && offset + 2 < init_info->cell_count)
+    {
+        const struct fdt_property* fdtprop = (const struct fdt_property*)(init_info->cells + offset + 1);
+        token->name = init_info->strings + be32(fdtprop->name_offset);
+        token->data = init_info->cells + offset + 3;
+        token->length = be32(fdtprop->length);
+        token->next += (dtb_align_up(token->length, FDT_CELL_SIZE) / FDT_CELL_SIZE) + 2;
+    }
+    else if (token->type == FDT_PROP)
+        token->type = FDT_NOP;
 }
 
-size_t dtb_read_prop_4(dtb_prop* prop, dtb_quad layout, dtb_quad* vals)
+static dtb_prop* parse_prop(struct dtb_init_info* init_info, size_t* offset)
 {
-    if (prop == NULL || layout.a == 0 || layout.b == 0 || layout.c == 0 || layout.d == 0)
-        return 0;
-
-    const uint32_t* prop_cells = prop->data;
-    const struct fdt_property* fdtprop = (const struct fdt_property*)(prop_cells - 2);
-    const size_t stride = layout.a + layout.b + layout.c + layout.d;
-    const size_t count = be32(fdtprop->length) / (stride * FDT_CELL_SIZE);
-    if (vals == NULL)
-        return count;
+    struct dtb_token token;
+    read_token(init_info, *offset, &token);
+    if (token.type != FDT_PROP)
+        return NULL;
 
-    for (size_t i = 0; i < count; i++)
+    dtb_prop* prop = alloc_prop(init_info, *offset + 1);
+    if (prop == NULL)
     {
-        const uint32_t* base = prop_cells + i * stride;
-        vals[i].a = extract_cells(base, layout.a); 
-        vals[i].b = extract_cells(base + layout.a, layout.b);
-        vals[i].c = extract_cells(base + layout.a + layout.b, layout.c);
-        vals[i].d = extract_cells(base + layout.a + layout.b + layout.c, layout.d);
+        LOG_ERROR("Property allocation failed");
+        return NULL;
     }
-    return count;
-}
 
-#ifdef SMOLDTB_ENABLE_WRITE_API
-/* ---- Section: Writable-Mode Private Functions ---- */
+    prop->name = ref_str(token.name);
+    prop->data = ref_data((void*)token.data);
+#ifndef SMOLDTB_COMPACT_NODES
+    prop->length = token.length;
+    prop->fromMalloc = false;
+    prop->dataFromMalloc = false;
+#endif
+    *offset = token.next;
 
-struct finalise_data
+    return prop;
+}
+
+/* Children and properties are appended so they stay in the same order as the blob, 'last'
+ * tracks the end of the list while a node is being parsed.
+ */
+static void add_child(dtb_node* node, dtb_node** last, dtb_node* child)
 {
-    uint32_t* struct_buf;
-    char* string_buf;
-    size_t struct_ptr;
-    size_t string_ptr;
-    size_t struct_buf_size;
-    size_t string_buf_size;
-    bool print_success;
-};
+    child->sibling = ref_node(NULL);
+    child->parent = ref_node(node);
+    child->sibling_index = node->child_count++;
+    if (*last != NULL)
+        (*last)->sibling = ref_node(child);
+    else
+        node->child = ref_node(child);
+    *last = child;
+}
 
-struct name_collision_check
+static void add_prop(dtb_node* node, dtb_prop** last, dtb_prop* prop)
 {
-    const char* name;
-    size_t name_len;
-    bool collision;
-};
+    prop->next = ref_prop(NULL);
+    prop->node = ref_node(node);
+    node->prop_count++;
+    if (*last != NULL)
+        (*last)->next = ref_prop(prop);
+    else
+        node->props = ref_prop(prop);
+    *last = prop;
+}
 
-static int destroy_props(dtb_node* node, dtb_prop* prop, void* opaque)
+/* The parent's subtree_end must already be set. */
+static void set_subtree_end(dtb_node* node)
 {
-    (void)node;
-    (void)opaque;
+    if (node_sibling(node) != NULL)
+        node->subtree_end = node->sibling;
+    else if (node_parent(node) != NULL)
+        node->subtree_end = node_parent(node)->subtree_end;
+    else
+        node->subtree_end = ref_node(NULL);
+}
 
-    if (prop->dataFromMalloc)
-        try_free(prop->data, prop->length);
-    if (prop->fromMalloc)
-        try_free(prop, sizeof(dtb_prop));
+#ifdef SMOLDTB_ENABLE_WRITE_API
+/* The write API can add and remove nodes anywhere, so rather than patching subtree_end as the
+ * tree is modified it's recalculated for the whole tree before the next walk.
+ */
+static void update_subtree_ends()
+{
+    state.subtree_ends_dirty = false;
+    dtb_node* node = state.root;
+    while (node != NULL)
+    {
+        set_subtree_end(node);
+        if (node_child(node) != NULL)
+        {
+            node = node_child(node);
+            continue;
+        }
 
-    return SMOLDTB_FOREACH_CONTINUE;
+        while (node != NULL && node_sibling(node) == NULL)
+            node = node_parent(node);
+        if (node != NULL)
+            node = node_sibling(node);
+    }
 }
+#endif
 
-static void destroy_dead_node(dtb_node* node)
+/* Skips over the rest of a node, starting just after its name. Child nodes are skipped
+ * entirely, only property lengths and name lengths are inspected. Returns the offset just
+ * after the node's FDT_END_NODE token.
+ */
+static size_t skip_node_body(struct dtb_init_info* init_info, size_t offset)
 {
-    if (node == NULL || node->parent != NULL)
-        return;
-
-    while (node->child != NULL)
+    size_t depth = 1;
+    while (offset < init_info->cell_count)
     {
-        dtb_node* deletee = node->child;
-        node->child = node->child->sibling;
-
-        deletee->parent = NULL;
-        destroy_dead_node(deletee);
+        struct dtb_token token;
+        read_token(init_info, offset, &token);
+        offset = token.next;
+        if (token.type == FDT_END_NODE)
+        {
+            if (--depth == 0)
+                break;
+        }
+        else if (token.type == FDT_BEGIN_NODE)
+            depth++;
     }
 
-    do_foreach_prop(node, destroy_props, NULL);
-    if (node->fromMalloc)
-        try_free(node, sizeof(dtb_node));
+    return offset;
 }
 
-static int init_finalise_data_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+/* Allocates a node for the FDT_BEGIN_NODE token at offset, and moves offset past the node's name. */
+static dtb_node* parse_node_begin(struct dtb_init_info* init_info, size_t* offset)
 {
-    (void)node;
-    if (node == NULL || prop == NULL)
-        return SMOLDTB_FOREACH_CONTINUE;
+    struct dtb_token token;
+    read_token(init_info, *offset, &token);
+    if (token.type != FDT_BEGIN_NODE)
+        return NULL;
 
-    struct finalise_data* data = opaque;
-    data->struct_buf_size += 3; /* +1 for FDT_PROP token, +2 for prop description struct */
-    data->struct_buf_size += dtb_align_up(prop->length, FDT_CELL_SIZE) / FDT_CELL_SIZE;
-    data->string_buf_size += string_len(prop->name) + 1; /* +1 for null terminator */
+    dtb_node* node = alloc_node(init_info, *offset);
+    if (node == NULL)
+    {
+        LOG_ERROR("Node allocation failed");
+        return NULL;
+    }
+    node->name = ref_str(token.name[0] == 0 ? NULL : token.name);
+#ifndef SMOLDTB_COMPACT_NODES
+    node->fromMalloc = false;
+#endif
+    *offset = token.next;
 
-    return SMOLDTB_FOREACH_CONTINUE;
+#ifdef SMOLDTB_LAZY_PARSE
+    node->offset = *offset;
+    node->expanded = false;
+#endif
+    return node;
 }
 
-static int init_finalise_data(dtb_node* node, void* opaque)
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+/* The index tables double in size as they fill up, but static builds can only free the most
+ * recent allocation and nodes are allocated in between, so every smaller copy would be left
+ * in the buffer. Counting the entries first lets each table be allocated once instead.
+ */
+struct dtb_index_counts
 {
-    if (node == NULL)
-        return SMOLDTB_FOREACH_CONTINUE;
-
-    struct finalise_data* data = opaque;
-    data->struct_buf_size += 2; /* +1 for BEGIN_NODE token, +1 for END_NODE token */
-    data->struct_buf_size += dtb_align_up(string_len(node->name) + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE; /* +1 for null terminator */
+    size_t phandles;
+    size_t compat_strings;
+    size_t path_entries;
+};
 
-    do_foreach_prop(node, init_finalise_data_prop, opaque);
-    do_foreach_sibling(node->child, init_finalise_data, opaque);
+static void count_index_node(struct dtb_index_counts* counts, const char* name)
+{
+#ifdef SMOLDTB_PATH_INDEX
+    /* see path_index_add_children() */
+    counts->path_entries += (string_find_char(name, '@') != -1ul) ? 2 : 1;
+#else
+    (void)counts;
+    (void)name;
+#endif
+}
 
-    return SMOLDTB_FOREACH_CONTINUE;
+static void count_index_prop(struct dtb_index_counts* counts, const char* name, const char* data, size_t length)
+{
+    if (is_phandle_name(name))
+        counts->phandles++;
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    else if (name[0] == 'c' && strings_eq(name, "compatible", sizeof("compatible")))
+        counts->compat_strings += count_strings(data, length);
+#else
+    (void)data;
+    (void)length;
+#endif
 }
 
-static int print_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+/* These are upper bounds, so the tables never need to grow while the tree is indexed. If
+ * there isn't room the tables are left as they are, and will fail to grow later on instead.
+ */
+static void reserve_indexes(const struct dtb_index_counts* counts)
 {
-    (void)node;
-    struct finalise_data* data = opaque;
+    if (counts->phandles * 2 > state.phandle_capacity)
+        phandle_index_grow(counts->phandles);
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    if (counts->compat_strings * 2 > state.compat_capacity)
+        compat_index_grow(counts->compat_strings);
+#endif
+#ifdef SMOLDTB_PATH_INDEX
+    if (counts->path_entries * 2 > state.path_capacity)
+        path_index_grow(counts->path_entries);
+#endif
+}
 
-    const uint32_t name_offset = data->string_ptr;
-    const size_t name_len = string_len(prop->name);
-    if (data->string_ptr + name_len + 1 > data->string_buf_size) /* bounds check */
+static void reserve_indexes_for_blob(const struct dtb_init_info* init_info)
+{
+    struct dtb_index_counts counts = { 0 };
+    size_t offset = 0;
+    while (offset < init_info->cell_count)
     {
-        data->print_success = false;
-        return SMOLDTB_FOREACH_ABORT;
-    }
+        struct dtb_token token;
+        read_token(init_info, offset, &token);
+        if (token.type == FDT_END || token.next > init_info->cell_count)
+            break;
 
-    memcpy(data->string_buf + data->string_ptr, prop->name, name_len);
-    data->string_buf[data->string_ptr + name_len] = 0;
-    data->string_ptr += name_len + 1; /* +1 for null terminator */
+        if (token.type == FDT_BEGIN_NODE)
+            count_index_node(&counts, token.name);
+        else if (token.type == FDT_PROP)
+            count_index_prop(&counts, token.name, token.data, token.length);
+        offset = token.next;
+    }
+    reserve_indexes(&counts);
+}
 
-    const size_t data_cells = dtb_align_up(prop->length, FDT_CELL_SIZE) / FDT_CELL_SIZE;
-    if (data->struct_ptr + 3 + data_cells > data->struct_buf_size) /* bounds check */
+#ifdef SMOLDTB_ENABLE_STREAMING
+static void reserve_indexes_for_tree()
+{
+    struct dtb_index_counts counts = { 0 };
+    for (struct dtb_arena_page* page = state.node_arena.head; page != NULL; page = page->next)
     {
-        data->print_success = false;
-        return SMOLDTB_FOREACH_ABORT;
+        for (size_t i = 0; i < page->used; i++)
+        {
+            dtb_node* node = arena_page_elem(&state.node_arena, page, i);
+            if (node_parent(node) != NULL)
+                count_index_node(&counts, node_name(node));
+        }
+    }
+    for (struct dtb_arena_page* page = state.prop_arena.head; page != NULL; page = page->next)
+    {
+        for (size_t i = 0; i < page->used; i++)
+        {
+            dtb_prop* prop = arena_page_elem(&state.prop_arena, page, i);
+            count_index_prop(&counts, prop_name(prop), prop_data(prop), prop_length(prop));
+        }
     }
+    reserve_indexes(&counts);
+}
+#endif
+#endif /* SMOLDTB_STATIC_BUFFER_SIZE */
 
-    data->struct_buf[data->struct_ptr++] = be32(FDT_PROP);
-    data->struct_buf[data->struct_ptr++] = be32((uint32_t)prop->length);
-    data->struct_buf[data->struct_ptr++] = be32(name_offset);
+#ifndef SMOLDTB_LAZY_PARSE
+static dtb_node* parse_node(struct dtb_init_info* init_info, size_t* offset)
+{
+    dtb_node* node = parse_node_begin(init_info, offset);
+    if (node == NULL)
+        return NULL;
 
-    uint32_t* prop_cells = prop->data;
-    for (size_t i = 0; i < data_cells; i++)
-        data->struct_buf[data->struct_ptr++] = prop_cells[i];
+    dtb_node* last_child = NULL;
+    dtb_prop* last_prop = NULL;
+    while (*offset < init_info->cell_count)
+    {
+        const uint32_t test = be32(init_info->cells[*offset]);
+        if (test == FDT_END_NODE)
+        {
+            (*offset)++;
+#ifdef SMOLDTB_PATH_INDEX
+            path_index_add_children(node);
+#endif
+            return node;
+        }
+        else if (test == FDT_BEGIN_NODE)
+        {
+            dtb_node* child = parse_node(init_info, offset);
+            if (child == NULL)
+                return NULL;
+            add_child(node, &last_child, child);
+        }
+        else if (test == FDT_PROP)
+        {
+            dtb_prop* prop = parse_prop(init_info, offset);
+            if (prop == NULL)
+                return NULL;
+            add_prop(node, &last_prop, prop);
+            if (!check_for_special_prop(node, prop))
+                return NULL;
+        }
+        else
+            (*offset)++;
+    }
 
-    return SMOLDTB_FOREACH_CONTINUE;
+    LOG_ERROR("Node is missing terminating tag.");
+    return NULL;
 }
 
-static int print_node(dtb_node* node, void* opaque)
+/* Parses every top level node in the struct block, the first one becomes the root. */
+static bool parse_roots(struct dtb_init_info* init_info)
 {
-    struct finalise_data* data = opaque;
-    const size_t name_len = string_len(node->name);
-    const size_t name_cells = dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE;
-
-    if (data->struct_ptr + 1 + name_cells > data->struct_buf_size) /* bounds check */
+    dtb_node* last_root = NULL;
+    for (size_t i = 0; i < init_info->cell_count; i++)
     {
-        data->print_success = false;
-        return SMOLDTB_FOREACH_ABORT;
+        if (be32(init_info->cells[i]) != FDT_BEGIN_NODE)
+            continue;
+
+        dtb_node* sub_root = parse_node(init_info, &i);
+        if (sub_root == NULL)
+            return false;
+        if (last_root != NULL)
+        {
+            last_root->sibling = ref_node(sub_root);
+            sub_root->sibling_index = last_root->sibling_index + 1;
+        }
+        else
+            state.root = sub_root;
+        last_root = sub_root;
     }
 
-    data->struct_buf[data->struct_ptr++] = be32(FDT_BEGIN_NODE);
+    return true;
+}
 
-    uint8_t* name_buf = (uint8_t*)(data->struct_buf + data->struct_ptr);
-    memcpy(name_buf, node->name, name_len);
-    name_buf[name_len] = 0;
-    data->struct_ptr += name_cells;
+#ifdef SMOLDTB_ENABLE_STREAMING
+/* Fills in the indexes for a tree that was parsed without them, since streamed property names
+ * only arrive with the strings block. Nodes and properties are stored in document order, so this
+ * matches the order a serial parse would add them in.
+ */
+static bool index_parsed_tree()
+{
+    for (struct dtb_arena_page* page = state.prop_arena.head; page != NULL; page = page->next)
+    {
+        for (size_t i = 0; i < page->used; i++)
+        {
+            dtb_prop* prop = arena_page_elem(&state.prop_arena, page, i);
+            if (!check_for_special_prop(prop_node(prop), prop))
+                return false;
+        }
+    }
+#ifdef SMOLDTB_PATH_INDEX
+    for (struct dtb_arena_page* page = state.node_arena.head; page != NULL; page = page->next)
+    {
+        for (size_t i = 0; i < page->used; i++)
+            path_index_add_children(arena_page_elem(&state.node_arena, page, i));
+    }
+#endif
+    return true;
+}
+#endif
 
-    do_foreach_prop(node, print_prop, opaque);
-    if (!data->print_success)
-        return SMOLDTB_FOREACH_ABORT;
-    do_foreach_sibling(node->child, print_node, opaque);
-    if (!data->print_success)
-        return SMOLDTB_FOREACH_ABORT;
+#else
+/* Parses the properties and direct children of a node, child nodes are left unexpanded. */
+static void expand_node(dtb_node* node)
+{
+    if (node == NULL || node->expanded)
+        return;
+    node->expanded = true;
 
-    if (data->struct_ptr + 1 > data->struct_buf_size) /* bounds check */
+    struct dtb_init_info* init_info = &state.lazy_info;
+    size_t offset = node->offset;
+    dtb_node* last_child = NULL;
+    dtb_prop* last_prop = NULL;
+    while (offset < init_info->cell_count)
     {
-        data->print_success = false;
-        return SMOLDTB_FOREACH_ABORT;
+        const uint32_t test = be32(init_info->cells[offset]);
+        if (test == FDT_END_NODE)
+        {
+            for (dtb_node* child = node_child(node); child != NULL; child = node_sibling(child))
+                set_subtree_end(child);
+#ifdef SMOLDTB_PATH_INDEX
+            path_index_add_children(node);
+#endif
+            return;
+        }
+        else if (test == FDT_BEGIN_NODE)
+        {
+            dtb_node* child = parse_node_begin(init_info, &offset);
+            if (child == NULL)
+                return;
+            add_child(node, &last_child, child);
+            offset = skip_node_body(init_info, offset);
+        }
+        else if (test == FDT_PROP)
+        {
+            dtb_prop* prop = parse_prop(init_info, &offset);
+            if (prop == NULL)
+                return;
+            add_prop(node, &last_prop, prop);
+            check_for_special_prop(node, prop);
+        }
+        else
+            offset++;
     }
-    data->struct_buf[data->struct_ptr++] = be32(FDT_END_NODE);
 
-    return SMOLDTB_FOREACH_CONTINUE;
+    LOG_ERROR("Node is missing terminating tag.");
 }
 
-static int check_sibling_name_collisions(dtb_node* node, void* opaque)
-{
-    struct name_collision_check* check = opaque;
+#endif
 
-    if (!strings_eq(node->name, check->name, check->name_len))
-        return SMOLDTB_FOREACH_CONTINUE;
+/* Returns the next node in a depth-first (pre-order) walk of the tree, expanding nodes as
+ * needed. This is the same order the nodes appear in the blob.
+ */
+static dtb_node* walk_next(dtb_node* node)
+{
+#ifdef SMOLDTB_ENABLE_WRITE_API
+    if (state.subtree_ends_dirty)
+        update_subtree_ends();
+#endif
 
-    check->collision = true;
-    return SMOLDTB_FOREACH_ABORT;
+    expand_node(node);
+    if (node_child(node) != NULL)
+        return node_child(node);
+    return node_subtree_end(node);
 }
 
-static int check_prop_name_collisions(dtb_node* node, dtb_prop* prop, void* opaque)
+#ifdef SMOLDTB_LAZY_PARSE
+static void expand_all()
 {
-    (void)node;
-    struct name_collision_check* check = opaque;
-
-    if (!strings_eq(prop->name, check->name, check->name_len))
-        return SMOLDTB_FOREACH_CONTINUE;
+    if (state.lazy_complete)
+        return;
 
-    check->collision = true;
-    return SMOLDTB_FOREACH_ABORT;
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node))
+        ;
+    state.lazy_complete = true;
 }
+#endif
 
-/* ---- Section: Writable-Mode Public API ---- */
+/* Ranges are decoded into smoldtb_values, which only keep the least significant cells of wider
+ * addresses. That's not enough to tell PCI's address spaces apart (the top cell), so buses with
+ * addresses wider than a smoldtb_value on either side can't be translated through.
+ */
+static bool ranges_addrs_fit(dtb_node* bus)
+{
+    return dtb_get_addr_cells_of(bus) * FDT_CELL_SIZE <= sizeof(smoldtb_value)
+        && dtb_get_addr_cells_of(node_parent(bus)) * FDT_CELL_SIZE <= sizeof(smoldtb_value);
+}
 
-size_t dtb_finalise_to_buffer(void* buffer, size_t buffer_size, uint32_t boot_cpu_id, dtb_reserved_memory* resv, size_t resv_count)
+#ifdef SMOLDTB_RANGES_CACHE
+static size_t ranges_slot(const dtb_node* bus)
 {
-    struct finalise_data final_data;
-    final_data.struct_buf_size = 0;
-    final_data.string_buf_size = 1; /* we'll use 1 byte for the empty string */
+    const uint32_t hash = (uint32_t)((uintptr_t)bus >> 4) * 0x9E3779B1u;
+    return (size_t)(hash ^ (hash >> 16)) & (state.ranges_capacity - 1);
+}
 
-    do_foreach_sibling(state.root, init_finalise_data, &final_data);
-    const size_t reserved_block_size = (resv_count + 1) * sizeof(dtb_reserved_memory);
-    const size_t struct_buf_bytes = final_data.struct_buf_size * FDT_CELL_SIZE;
-    const size_t total_bytes = final_data.string_buf_size + struct_buf_bytes + 
-        sizeof(struct fdt_header) + reserved_block_size;
+/* Buses with addresses wider than smoldtb_value on either side (like PCI's 3 cells, where the
+ * top cell is the address space) are left out, translate_through() refuses them anyway.
+ */
+static bool has_ranges_entries(dtb_node* node)
+{
+    dtb_prop* ranges = find_known_prop(node, KNOWN_PROP_RANGES, "ranges");
+    return ranges != NULL && prop_length(ranges) != 0 && node_parent(node) != NULL
+        && ranges_addrs_fit(node);
+}
 
-    if (buffer == NULL || total_bytes < buffer_size)
-        return total_bytes;
-    if ((uintptr_t)buffer & 0b11)
-        return SMOLDTB_FINALISE_FAILURE; /* check buffer is aligned to a 32-bit boundary */
+/* Returns true if any of the ranges overlap, they must already be sorted by child address. */
+static bool ranges_overlap(const dtb_triplet* ranges, size_t count)
+{
+    /* the range reaching furthest so far, ends are clamped in case they wrap around */
+    smoldtb_value end = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (ranges[i].a < end)
+            return true;
 
-    struct fdt_header* header = (struct fdt_header*)buffer;
-    header->magic = be32(FDT_MAGIC);
-    header->total_size = be32(total_bytes);
-    header->offset_structs = be32(sizeof(struct fdt_header) + 16); /* size of reserved block */
-    header->offset_strings = be32(be32(header->offset_structs) + struct_buf_bytes);
-    header->offset_memmap_rsvd = be32(sizeof(struct fdt_header));
-    header->version = be32(FDT_VERSION);
-    header->last_comp_version = be32(16); /* as per spec, this field must be 16. */
-    header->boot_cpu_id = be32(boot_cpu_id);
-    header->size_strings = be32(final_data.string_buf_size);
-    header->size_structs = be32(struct_buf_bytes);
+        const smoldtb_value range_end = ranges[i].a + ranges[i].c;
+        if (range_end < ranges[i].a)
+            return i + 1 < count; /* covers the rest of the address space */
+        if (range_end > end)
+            end = range_end;
+    }
+    return false;
+}
 
-    uint64_t* reserved_block = (uint64_t*)(header + 1);
-    for (size_t i = 0; i < resv_count; i++)
+/* Decodes a bus's ranges into the arena and sorts them by child address. Tables are
+ * rarely more than a handful of entries, so an insertion sort is plenty.
+ */
+static bool ranges_cache_add(dtb_node* bus)
+{
+    dtb_triplet layout;
+    layout.a = dtb_get_addr_cells_of(bus);
+    layout.b = dtb_get_addr_cells_of(node_parent(bus));
+    layout.c = dtb_get_size_cells_of(bus);
+
+    dtb_prop* prop = find_known_prop(bus, KNOWN_PROP_RANGES, "ranges");
+    const size_t count = dtb_read_prop_3(prop, layout, NULL);
+    dtb_triplet* ranges = NULL;
+    if (count != 0)
     {
-        reserved_block[i * 2 + 0] = be64(resv[i].base);
-        reserved_block[i * 2 + 1] = be64(resv[i].length);
+        ranges = arena_alloc_run(&state.ranges_arena, count, 0);
+        if (ranges == NULL)
+            return false;
+        dtb_read_prop_3(prop, layout, ranges);
     }
-    reserved_block[resv_count * 2 + 0] = 0;
-    reserved_block[resv_count * 2 + 1] = 0;
 
-    final_data.struct_buf = (uint32_t*)((uintptr_t)buffer + be32(header->offset_structs));
-    final_data.string_buf = (char*)((uintptr_t)buffer + be32(header->offset_strings));
-    final_data.struct_ptr = 0;
-    final_data.string_ptr = 1;
-    final_data.string_buf[0] = 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        const dtb_triplet range = ranges[i];
+        size_t j = i;
+        for (; j > 0 && ranges[j - 1].a > range.a; j--)
+            ranges[j] = ranges[j - 1];
+        ranges[j] = range;
+    }
 
-    final_data.print_success = true;
-    do_foreach_sibling(state.root, print_node, &final_data);
-    return final_data.print_success ? total_bytes : SMOLDTB_FINALISE_FAILURE;
+    const bool sorted = !ranges_overlap(ranges, count);
+    if (!sorted)
+        dtb_read_prop_3(prop, layout, ranges);
+
+    size_t slot = ranges_slot(bus);
+    while (state.ranges_table[slot].bus != NULL)
+        slot = (slot + 1) & (state.ranges_capacity - 1);
+    state.ranges_table[slot].bus = bus;
+    state.ranges_table[slot].ranges = ranges;
+    state.ranges_table[slot].count = count;
+    state.ranges_table[slot].sorted = sorted;
+    return true;
 }
 
-dtb_node* dtb_find_or_create_node(const char* path)
+/* Counts the buses first, so the table can be allocated at its final size. */
+static void build_ranges_cache()
 {
-    if (path == NULL)
-        return NULL;
+#ifdef SMOLDTB_LAZY_PARSE
+    state.ranges_built = true;
+    expand_all();
+#endif
+    state.ranges_valid = false;
 
-    size_t seg_len;
-    dtb_node* scan = state.root;
-    while (scan != NULL)
+    size_t bus_count = 0;
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node))
     {
-        while (path[0] == '/')
-            path++;
+        if (has_ranges_entries(node))
+            bus_count++;
+    }
 
-        seg_len = string_find_char(path, '/');
-        if (seg_len == -1ul)
-            seg_len = string_len(path);
-        if (seg_len == 0)
-            return scan;
+    size_t capacity = RANGES_MIN_CAPACITY;
+    while (capacity < bus_count * 2)
+        capacity *= 2;
+    state.ranges_table = buff_alloc(capacity * sizeof(struct dtb_ranges_entry));
+    if (state.ranges_table == NULL)
+    {
+        LOG_ERROR("Not enough space for ranges cache.");
+        return;
+    }
+    state.ranges_capacity = capacity;
+    for (size_t i = 0; i < capacity; i++)
+        state.ranges_table[i].bus = NULL;
 
-        dtb_node* next = find_child_internal(scan, path, seg_len);
-        if (next == NULL)
-            next = dtb_create_child(scan, path);
-        scan = next;
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node))
+    {
+        if (has_ranges_entries(node) && !ranges_cache_add(node))
+        {
+            LOG_ERROR("Not enough space for ranges cache.");
+            return;
+        }
     }
 
-    return NULL;
+    state.ranges_valid = true;
 }
 
-dtb_prop* dtb_find_or_create_prop(dtb_node* node, const char* name)
+static const struct dtb_ranges_entry* ranges_cache_find(const dtb_node* bus)
 {
-    if (node == NULL || name == NULL)
+#ifdef SMOLDTB_LAZY_PARSE
+    if (!state.ranges_built)
+        build_ranges_cache();
+#endif
+    if (!state.ranges_valid)
         return NULL;
 
-    dtb_prop* prop = dtb_find_prop(node, name);
-    if (prop == NULL)
-        prop = dtb_create_prop(node, name);
-    return prop;
-}
+    size_t slot = ranges_slot(bus);
+    while (state.ranges_table[slot].bus != NULL)
+    {
+        if (state.ranges_table[slot].bus == bus)
+            return &state.ranges_table[slot];
+        slot = (slot + 1) & (state.ranges_capacity - 1);
+    }
+    return NULL;
+}
+#endif
 
-dtb_node* dtb_create_sibling(dtb_node* node, const char* name)
+/* Reads a property containing a single cell, or returns or_default if it's missing. */
+static size_t read_cell_prop(dtb_node* node, const char* name, size_t or_default)
 {
-    if (node == NULL || name == NULL || node->parent == NULL) /* creating siblings of root node is disallowed */
-        return NULL;
+    dtb_prop* prop = dtb_find_prop(node, name);
+    if (prop == NULL || prop_data(prop) == NULL || prop_length(prop) < FDT_CELL_SIZE)
+        return or_default;
 
-    struct name_collision_check check_data;
-    check_data.collision = false;
-    check_data.name = name;
-    check_data.name_len = string_len(name);
-    if (string_find_char(name, '/') < check_data.name_len)
-        check_data.name_len = string_find_char(name, '/');
+    return be32(*(const uint32_t*)prop_data(prop));
+}
 
-    do_foreach_sibling(node->parent->child, check_sibling_name_collisions, &check_data);
-    if (check_data.collision)
+/* Returns the target of a node's 'interrupt-parent' property, or its parent if it has none. */
+static dtb_node* interrupt_parent_of(dtb_node* node)
+{
+    uint32_t handle;
+    dtb_prop* prop = dtb_find_prop(node, "interrupt-parent");
+    if (prop != NULL && read_phandle(prop, &handle))
+        return dtb_find_phandle(handle);
+    return node_parent(node);
+}
+
+/* Follows interrupt parents until a node with #interrupt-cells, which defines an interrupt domain. */
+static dtb_node* find_interrupt_parent(dtb_node* node)
+{
+    for (size_t depth = 0; depth < IRQ_MAX_DEPTH && node != NULL; depth++)
     {
-        LOG_ERROR("Failed to create node with duplicate name.");
-        return NULL;
+        node = interrupt_parent_of(node);
+        if (node != NULL && dtb_find_prop(node, "#interrupt-cells") != NULL)
+            return node;
     }
 
-    const size_t name_len = string_len(name);
-    char* name_buf = try_malloc(name_len + 1);
-    if (name_buf == NULL)
-        return NULL;
-    memcpy(name_buf, name, name_len);
+    return NULL;
+}
 
-    dtb_node* sibling = try_malloc(sizeof(dtb_node));
-    if (sibling == NULL)
+/* The number of unit address cells in a nexus's interrupt-map keys. A nexus without
+ * #address-cells uses the closest ancestor's, or 2 if none of them have it, like Linux does.
+ */
+static size_t irq_nexus_addr_cells(dtb_node* node)
+{
+    for (; node != NULL; node = node_parent(node))
     {
-        LOG_ERROR("Failed to allocate node for sibling.");
+        dtb_prop* prop = find_known_prop(node, KNOWN_PROP_ADDR_CELLS, "#address-cells");
+        if (prop != NULL && prop_data(prop) != NULL && prop_length(prop) >= FDT_CELL_SIZE)
+            return be32(*(const uint32_t*)prop_data(prop));
+    }
+    return 2;
+}
+
+/* Returns false if the node's interrupt-map uses more cells than we can store. */
+static bool read_irq_nexus(dtb_node* node, struct dtb_irq_nexus* nexus)
+{
+    const size_t addr_cells = irq_nexus_addr_cells(node);
+    const size_t spec_cells = read_cell_prop(node, "#interrupt-cells", -1ul);
+    if (addr_cells > IRQ_ADDR_CELLS || spec_cells > SMOLDTB_MAX_INTERRUPT_CELLS)
+        return false;
+
+    nexus->node = node;
+    nexus->addr_cells = addr_cells;
+    nexus->spec_cells = spec_cells;
+    for (size_t i = 0; i < IRQ_KEY_CELLS; i++)
+        nexus->mask[i] = 0xFFFFFFFF;
+
+    dtb_prop* mask = dtb_find_prop(node, "interrupt-map-mask");
+    if (mask != NULL && prop_data(mask) != NULL)
+    {
+        const uint32_t* cells = prop_data(mask);
+        const size_t count = prop_length(mask) / FDT_CELL_SIZE;
+        for (size_t i = 0; i < addr_cells + spec_cells && i < count; i++)
+            nexus->mask[i] = be32(cells[i]);
+    }
+
+    return true;
+}
+
+/* Decodes the interrupt-map entry at *cells and advances past it. Returns false at the end of
+ * the map, or if the entry is malformed (in which case the rest of the map can't be decoded).
+ */
+static bool next_irq_map_entry(const struct dtb_irq_nexus* nexus, const uint32_t** cells, const uint32_t* end, struct dtb_irq_map_entry* entry)
+{
+    const size_t key_cells = nexus->addr_cells + nexus->spec_cells;
+    const uint32_t* scan = *cells;
+    if ((size_t)(end - scan) < key_cells + 1)
+        return false;
+
+    for (size_t i = 0; i < key_cells; i++)
+        entry->key[i] = be32(scan[i]) & nexus->mask[i];
+    scan += key_cells;
+
+    entry->parent = dtb_find_phandle(be32(*scan));
+    scan++;
+    if (entry->parent == NULL)
+        return false;
+
+    const size_t addr_cells = read_cell_prop(entry->parent, "#address-cells", 0);
+    const size_t spec_cells = read_cell_prop(entry->parent, "#interrupt-cells", -1ul);
+    if (addr_cells > IRQ_ADDR_CELLS || spec_cells > SMOLDTB_MAX_INTERRUPT_CELLS
+        || (size_t)(end - scan) < addr_cells + spec_cells)
+        return false;
+
+    entry->nexus = nexus->node;
+    entry->parent_addr_cells = addr_cells;
+    entry->parent_spec_cells = spec_cells;
+    for (size_t i = 0; i < addr_cells; i++)
+        entry->parent_addr[i] = be32(scan[i]);
+    for (size_t i = 0; i < spec_cells; i++)
+        entry->parent_spec[i] = be32(scan[addr_cells + i]);
+
+    *cells = scan + addr_cells + spec_cells;
+    return true;
+}
+
+static bool irq_map_span(dtb_node* node, const uint32_t** begin, const uint32_t** end)
+{
+    dtb_prop* map = dtb_find_prop(node, "interrupt-map");
+    if (map == NULL || prop_data(map) == NULL)
+        return false;
+
+    *begin = prop_data(map);
+    *end = *begin + prop_length(map) / FDT_CELL_SIZE;
+    return true;
+}
+
+static bool irq_keys_eq(const uint32_t* a, const uint32_t* b, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+static uint32_t irq_map_hash(const dtb_node* nexus, const uint32_t* key, size_t key_cells)
+{
+    uint32_t hash = (uint32_t)((uintptr_t)nexus >> 4) * 0x9E3779B1u;
+    for (size_t i = 0; i < key_cells; i++)
+        hash = (hash ^ key[i]) * 16777619u;
+    return hash ^ (hash >> 16);
+}
+
+static size_t irq_nexus_slot(const dtb_node* node)
+{
+    const uint32_t hash = (uint32_t)((uintptr_t)node >> 4) * 0x9E3779B1u;
+    return (size_t)(hash ^ (hash >> 16)) & (state.irq_nexus_capacity - 1);
+}
+
+/* Adds an entry unless the nexus already maps the same key, as only the first one can match. */
+static void irq_map_cache_add(const struct dtb_irq_nexus* nexus, struct dtb_irq_map_entry* entry)
+{
+    const size_t key_cells = nexus->addr_cells + nexus->spec_cells;
+    entry->hash = irq_map_hash(nexus->node, entry->key, key_cells);
+
+    const size_t mask = state.irq_map_capacity - 1;
+    size_t slot = entry->hash & mask;
+    while (state.irq_map_table[slot].nexus != NULL)
+    {
+        const struct dtb_irq_map_entry* other = &state.irq_map_table[slot];
+        if (other->nexus == nexus->node && other->hash == entry->hash && irq_keys_eq(other->key, entry->key, key_cells))
+            return;
+        slot = (slot + 1) & mask;
+    }
+    state.irq_map_table[slot] = *entry;
+}
+
+static size_t table_capacity_for(size_t count)
+{
+    size_t capacity = IRQ_MIN_CAPACITY;
+    while (capacity < count * 2)
+        capacity *= 2;
+    return capacity;
+}
+
+/* Counts the nexuses and their entries first, so both tables can be allocated at their final size. */
+static void build_irq_map_cache()
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    state.irq_map_built = true;
+    expand_all();
+#endif
+    state.irq_map_valid = false;
+
+    size_t nexus_count = 0;
+    size_t entry_count = 0;
+    struct dtb_irq_nexus nexus;
+    struct dtb_irq_map_entry entry;
+    const uint32_t* cells;
+    const uint32_t* end;
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node))
+    {
+        if (!irq_map_span(node, &cells, &end) || !read_irq_nexus(node, &nexus))
+            continue;
+
+        nexus_count++;
+        while (next_irq_map_entry(&nexus, &cells, end, &entry))
+            entry_count++;
+    }
+
+    const size_t nexus_capacity = table_capacity_for(nexus_count);
+    const size_t map_capacity = table_capacity_for(entry_count);
+    state.irq_nexus_table = buff_alloc(nexus_capacity * sizeof(struct dtb_irq_nexus));
+    if (state.irq_nexus_table == NULL)
+    {
+        LOG_ERROR("Not enough space for interrupt-map cache.");
+        return;
+    }
+    state.irq_nexus_capacity = nexus_capacity;
+    state.irq_map_table = buff_alloc(map_capacity * sizeof(struct dtb_irq_map_entry));
+    if (state.irq_map_table == NULL)
+    {
+        LOG_ERROR("Not enough space for interrupt-map cache.");
+        return;
+    }
+    state.irq_map_capacity = map_capacity;
+    for (size_t i = 0; i < nexus_capacity; i++)
+        state.irq_nexus_table[i].node = NULL;
+    for (size_t i = 0; i < map_capacity; i++)
+        state.irq_map_table[i].nexus = NULL;
+
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node))
+    {
+        if (!irq_map_span(node, &cells, &end) || !read_irq_nexus(node, &nexus))
+            continue;
+
+        size_t slot = irq_nexus_slot(node);
+        while (state.irq_nexus_table[slot].node != NULL)
+            slot = (slot + 1) & (nexus_capacity - 1);
+        state.irq_nexus_table[slot] = nexus;
+
+        while (next_irq_map_entry(&nexus, &cells, end, &entry))
+            irq_map_cache_add(&nexus, &entry);
+    }
+
+    state.irq_map_valid = true;
+}
+
+static const struct dtb_irq_nexus* irq_nexus_find(const dtb_node* node)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    if (!state.irq_map_built)
+        build_irq_map_cache();
+#endif
+    if (!state.irq_map_valid)
         return NULL;
+
+    size_t slot = irq_nexus_slot(node);
+    while (state.irq_nexus_table[slot].node != NULL)
+    {
+        if (state.irq_nexus_table[slot].node == node)
+            return &state.irq_nexus_table[slot];
+        slot = (slot + 1) & (state.irq_nexus_capacity - 1);
+    }
+    return NULL;
+}
+#endif
+
+/* Reads the next window from a node's reg, translated to a cpu address. Entries that can't be
+ * translated, or have a size of 0, are skipped over.
+ */
+static bool next_addr_window(dtb_node* node, dtb_cell_reader* reader, dtb_pair layout, struct dtb_addr_window* window)
+{
+    dtb_pair entry;
+    while (dtb_reader_next_pair(reader, layout, &entry))
+    {
+        smoldtb_value base;
+        if (entry.b == 0 || !dtb_translate_address(node, entry.a, &base))
+            continue;
+
+        window->base = base;
+        window->last = base + (entry.b - 1);
+        if (window->last < base)
+            window->last = (smoldtb_value)-1;
+        window->node = node;
+        return true;
+    }
+
+    return false;
+}
+
+static dtb_cell_reader reg_reader(dtb_node* node, dtb_pair* layout)
+{
+    layout->a = dtb_get_addr_cells_for(node);
+    layout->b = dtb_get_size_cells_for(node);
+    return dtb_get_cell_reader(find_known_prop(node, KNOWN_PROP_REG, "reg"));
+}
+
+/* Returns true if window a is a better match than b: it's smaller, or the same size and later in
+ * the tree (so a child wins over a parent with the same window).
+ */
+static bool addr_window_better(const struct dtb_addr_window* a, const struct dtb_addr_window* b)
+{
+    const smoldtb_value a_size = a->last - a->base;
+    const smoldtb_value b_size = b->last - b->base;
+    if (a_size != b_size)
+        return a_size < b_size;
+    return a->order > b->order;
+}
+
+#ifdef SMOLDTB_ADDRESS_INDEX
+static void sift_windows_by_base(struct dtb_addr_window* windows, size_t count, size_t root)
+{
+    while (root * 2 + 1 < count)
+    {
+        size_t child = root * 2 + 1;
+        if (child + 1 < count && windows[child + 1].base > windows[child].base)
+            child++;
+        if (windows[root].base >= windows[child].base)
+            return;
+
+        const struct dtb_addr_window temp = windows[root];
+        windows[root] = windows[child];
+        windows[child] = temp;
+        root = child;
+    }
+}
+
+/* Heapsort, so building the index doesn't need any more memory than the windows themselves. */
+static void sort_windows_by_base(struct dtb_addr_window* windows, size_t count)
+{
+    for (size_t i = count / 2; i > 0; i--)
+        sift_windows_by_base(windows, count, i - 1);
+    for (size_t i = count; i > 1; i--)
+    {
+        const struct dtb_addr_window temp = windows[0];
+        windows[0] = windows[i - 1];
+        windows[i - 1] = temp;
+        sift_windows_by_base(windows, i - 1, 0);
+    }
+}
+
+/* The open windows during the sweep are kept in a binary heap, with the best match on top. */
+static void active_push(struct dtb_addr_window** heap, size_t* count, struct dtb_addr_window* window)
+{
+    size_t i = (*count)++;
+    heap[i] = window;
+    while (i > 0 && addr_window_better(heap[i], heap[(i - 1) / 2]))
+    {
+        struct dtb_addr_window* temp = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = temp;
+        i = (i - 1) / 2;
+    }
+}
+
+static void active_pop(struct dtb_addr_window** heap, size_t* count)
+{
+    heap[0] = heap[--(*count)];
+    size_t i = 0;
+    while (i * 2 + 1 < *count)
+    {
+        size_t child = i * 2 + 1;
+        if (child + 1 < *count && addr_window_better(heap[child + 1], heap[child]))
+            child++;
+        if (!addr_window_better(heap[child], heap[i]))
+            return;
+
+        struct dtb_addr_window* temp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = temp;
+        i = child;
+    }
+}
+
+static void add_addr_segment(smoldtb_value start, dtb_node* node)
+{
+    if (state.addr_segment_count != 0)
+    {
+        struct dtb_addr_segment* prev = &state.addr_segments[state.addr_segment_count - 1];
+        if (prev->node == node)
+            return;
+        if (prev->start == start)
+        {
+            prev->node = node;
+            return;
+        }
+    }
+
+    state.addr_segments[state.addr_segment_count].start = start;
+    state.addr_segments[state.addr_segment_count].node = node;
+    state.addr_segment_count++;
+}
+
+/* Sweeps over the start and end of every window in address order. Between each pair of these
+ * points the owner of the address space is the best of the open windows (or nobody), which
+ * gives at most two segments per window. Static builds can only free the latest allocation, so
+ * the segments (which are kept) are allocated before the temporary buffers.
+ */
+static void build_addr_index()
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    state.addr_built = true;
+    expand_all();
+#endif
+    state.addr_valid = false;
+
+    size_t count = 0;
+    dtb_pair layout;
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node))
+    {
+        dtb_cell_reader reader = reg_reader(node, &layout);
+        while (dtb_reader_next_pair(&reader, layout, NULL))
+            count++;
+    }
+
+    const size_t segments_size = (count * 2 + 1) * sizeof(struct dtb_addr_segment);
+    const size_t windows_size = count * sizeof(struct dtb_addr_window);
+    const size_t heap_size = count * sizeof(struct dtb_addr_window*);
+    state.addr_segments = buff_alloc(segments_size);
+    struct dtb_addr_window* windows = buff_alloc(windows_size);
+    struct dtb_addr_window* ends = buff_alloc(windows_size);
+    struct dtb_addr_window** heap = buff_alloc(heap_size);
+    if (state.addr_segments == NULL || windows == NULL || ends == NULL || heap == NULL)
+    {
+        LOG_ERROR("Not enough space for address index.");
+        if (heap != NULL)
+            buff_free(heap, heap_size);
+        if (ends != NULL)
+            buff_free(ends, windows_size);
+        if (windows != NULL)
+            buff_free(windows, windows_size);
+        if (state.addr_segments != NULL)
+            buff_free(state.addr_segments, segments_size);
+        state.addr_segments = NULL;
+        return;
+    }
+    state.addr_segment_capacity = count * 2 + 1;
+    state.addr_segment_count = 0;
+
+    size_t window_count = 0;
+    size_t order = 0;
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node), order++)
+    {
+        dtb_cell_reader reader = reg_reader(node, &layout);
+        while (window_count < count && next_addr_window(node, &reader, layout, &windows[window_count]))
+        {
+            windows[window_count].order = order;
+            window_count++;
+        }
+    }
+
+    /* ends[] holds the first address after each window, windows reaching the top never end */
+    size_t end_count = 0;
+    for (size_t i = 0; i < window_count; i++)
+    {
+        if (windows[i].last == (smoldtb_value)-1)
+            continue;
+        ends[end_count] = windows[i];
+        ends[end_count].base = windows[i].last + 1;
+        end_count++;
+    }
+    sort_windows_by_base(windows, window_count);
+    sort_windows_by_base(ends, end_count);
+
+    add_addr_segment(0, NULL);
+    size_t next_start = 0;
+    size_t next_end = 0;
+    size_t active_count = 0;
+    while (next_start < window_count || next_end < end_count)
+    {
+        smoldtb_value point = 0;
+        if (next_end == end_count || (next_start < window_count && windows[next_start].base <= ends[next_end].base))
+            point = windows[next_start].base;
+        else
+            point = ends[next_end].base;
+
+        while (next_start < window_count && windows[next_start].base == point)
+            active_push(heap, &active_count, &windows[next_start++]);
+        while (next_end < end_count && ends[next_end].base == point)
+            next_end++;
+        /* windows are removed once they reach the top of the heap, after they've closed */
+        while (active_count != 0 && heap[0]->last < point)
+            active_pop(heap, &active_count);
+
+        add_addr_segment(point, active_count == 0 ? NULL : heap[0]->node);
+    }
+
+    buff_free(heap, heap_size);
+    buff_free(ends, windows_size);
+    buff_free(windows, windows_size);
+    state.addr_valid = true;
+}
+
+static bool find_by_address_indexed(smoldtb_value addr, dtb_node** found)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    if (!state.addr_built)
+        build_addr_index();
+#endif
+    if (!state.addr_valid)
+        return false;
+
+    /* find the last segment starting at or below addr, there's always one starting at 0 */
+    size_t low = 0;
+    size_t high = state.addr_segment_count;
+    while (high - low > 1)
+    {
+        const size_t mid = low + (high - low) / 2;
+        if (state.addr_segments[mid].start <= addr)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    *found = state.addr_segments[low].node;
+    return true;
+}
+#endif
+
+/* ---- Section: Readonly-Mode Public API ---- */
+
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+#ifdef SMOLDTB_LAZY_PARSE
+/* Lazy builds don't parse nodes in document order, so the index is built on first use. */
+static void build_compat_index()
+{
+    state.compat_built = true;
+    state.compat_valid = false;
+
+    expand_all();
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node))
+    {
+        dtb_prop* prop = find_known_prop(node, KNOWN_PROP_COMPATIBLE, "compatible");
+        if (prop != NULL && !compat_index_add(node, prop))
+        {
+            LOG_ERROR("Not enough space for compatible index.");
+            return;
+        }
+    }
+
+    state.compat_valid = true;
+}
+#endif
+
+/* Returns false if the index can't answer this query, and a full search is needed. */
+static bool find_compatible_indexed(dtb_node* start, const char* str, dtb_node** found)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    if (!state.compat_built)
+        build_compat_index();
+#endif
+    if (!state.compat_valid || str == NULL)
+        return false;
+
+    if (state.compat_count == 0)
+    {
+        *found = NULL;
+        return true;
+    }
+
+    size_t len;
+    const uint32_t hash = string_hash(str, -1ul, &len);
+    const struct dtb_compat_entry* entry = &state.compat_table[compat_slot(str, len, hash)];
+    if (entry->str == NULL)
+    {
+        *found = NULL;
+        return true;
+    }
+
+    struct dtb_compat_match* match = entry->first;
+    if (start != NULL)
+    {
+        /* continue from the start node's own record for this string */
+        size_t i = 0;
+        while (i < start->compat_count && start->compat[i].key != entry->str)
+            i++;
+        if (i == start->compat_count)
+            return false;
+        match = start->compat[i].next;
     }
 
-    sibling->name = name_buf;
-    sibling->parent = node->parent;
+    *found = (match == NULL) ? NULL : match->node;
+    return true;
+}
+#endif
+
+/* Releases the previous tree and prepares the arenas for parsing a new one. */
+static void begin_parse()
+{
+    free_buffers();
+    state.root = NULL;
+    arena_init(&state.node_arena, sizeof(dtb_node));
+    arena_init(&state.prop_arena, sizeof(dtb_prop));
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    arena_init(&state.compat_arena, sizeof(struct dtb_compat_match));
+#endif
+#ifdef SMOLDTB_PATH_INDEX
+    state.path_valid = true; //filled in as each node's children are parsed
+#endif
+#ifdef SMOLDTB_RANGES_CACHE
+    arena_init(&state.ranges_arena, sizeof(dtb_triplet));
+#endif
+}
+
+#ifndef SMOLDTB_LAZY_PARSE
+/* Links up the subtree ends and builds the caches, once every node has been parsed. */
+static void finish_parse()
+{
+    /* Nodes were allocated in pre-order, so parents are always visited before their children. */
+    for (struct dtb_arena_page* page = state.node_arena.head; page != NULL; page = page->next)
+    {
+        for (size_t i = 0; i < page->used; i++)
+            set_subtree_end(arena_page_elem(&state.node_arena, page, i));
+    }
+#ifdef SMOLDTB_RANGES_CACHE
+    build_ranges_cache();
+#endif
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+    build_irq_map_cache();
+#endif
+#ifdef SMOLDTB_ADDRESS_INDEX
+    build_addr_index();
+#endif
+}
+#endif
+
+size_t dtb_query_total_size(uintptr_t fdt_start)
+{
+    if (fdt_start == 0)
+        return 0;
+
+    struct fdt_header* header = (struct fdt_header*)fdt_start;
+    if (be32(header->magic) != FDT_MAGIC)
+        return 0;
+
+    return be32(header->total_size);
+}
+
+bool dtb_init(uintptr_t start, dtb_ops ops)
+{
+    state.ops = ops;
+
+#if !defined(SMOLDTB_STATIC_BUFFER_SIZE)
+    if (state.ops.malloc == NULL)
+    {
+        LOG_ERROR("smoldtb has been compiled without an internal static buffer, but not passed a malloc() function.");
+        return false;
+    }
+#endif
+
+    struct dtb_init_info init_info;
+    if (start == SMOLDTB_INIT_EMPTY_TREE)
+    {
+        state.root = NULL;
+        state.strings = NULL;
+        state.strings_size = 0;
+        state.resv_memory = NULL;
+        state.resv_count = 0;
+        return true;
+    }
+
+    struct fdt_header* header = (struct fdt_header*)start;
+    if (be32(header->magic) != FDT_MAGIC)
+    {
+        LOG_ERROR("FDT has incorrect magic number.");
+        return false;
+    }
+#ifdef SMOLDTB_COMPACT_NODES
+    /* offsets into the blob share 32 bits with the REF_IN_BUFF flag */
+    if (be32(header->total_size) >= REF_IN_BUFF)
+    {
+        LOG_ERROR("FDT is too large for SMOLDTB_COMPACT_NODES.");
+        return false;
+    }
+    state.blob_start = start;
+#endif
+
+    /* the reserved memory block ends with an entry where both the address and size are 0 */
+    state.resv_memory = (uint64_t*)(start + be32(header->offset_memmap_rsvd));
+    state.resv_count = 0;
+    const size_t resv_max = (be32(header->total_size) - be32(header->offset_memmap_rsvd)) / sizeof(struct fdt_reserved_mem_entry);
+    while (state.resv_count < resv_max
+        && (state.resv_memory[state.resv_count * 2] != 0 || state.resv_memory[state.resv_count * 2 + 1] != 0))
+        state.resv_count++;
+    init_info.cells = (const uint32_t*)(start + be32(header->offset_structs));
+    init_info.cell_count = be32(header->size_structs) / sizeof(uint32_t);
+    init_info.strings = (const char*)(start + be32(header->offset_strings));
+    state.strings = init_info.strings;
+    state.strings_size = be32(header->size_strings);
+
+    begin_parse();
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    reserve_indexes_for_blob(&init_info);
+#endif
+
+#ifdef SMOLDTB_LAZY_PARSE
+    /* Only the root node is created here, everything else is parsed as it's accessed. */
+    state.lazy_info = init_info;
+    state.lazy_complete = false;
+    size_t offset = 0;
+    while (offset < init_info.cell_count && be32(init_info.cells[offset]) != FDT_BEGIN_NODE)
+        offset++;
+    if (offset == init_info.cell_count)
+        return true;
+
+    state.root = parse_node_begin(&state.lazy_info, &offset);
+    if (state.root == NULL)
+    {
+        LOG_ERROR("Failed to parse FDT struct block.");
+        free_buffers();
+        return false;
+    }
+#else
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    state.compat_valid = true; //filled in while parsing, see check_for_special_prop()
+#endif
+    if (!parse_roots(&init_info))
+    {
+        LOG_ERROR("Failed to parse FDT struct block.");
+        free_buffers();
+        state.root = NULL;
+        return false;
+    }
+    finish_parse();
+#endif
+
+    return true;
+}
+
+/* Searches from start, until (but not including) end. */
+static dtb_node* find_compatible_scan(dtb_node* start, dtb_node* end, const char* str)
+{
+    for (dtb_node* node = start; node != end && node != NULL; node = walk_next(node))
+    {
+        if (dtb_is_compatible(node, str))
+            return node;
+    }
+
+    return NULL;
+}
+
+dtb_node* dtb_find_compatible(dtb_node* start, const char* str)
+{
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    dtb_node* found;
+    if (find_compatible_indexed(start, str, &found))
+        return found;
+#endif
+
+    return find_compatible_scan(start == NULL ? state.root : walk_next(start), NULL, str);
+}
+
+dtb_node* dtb_find_compatible_in(dtb_node* subtree, dtb_node* start, const char* str)
+{
+    if (subtree == NULL)
+        return NULL;
+
+#ifdef SMOLDTB_ENABLE_WRITE_API
+    if (state.subtree_ends_dirty)
+        update_subtree_ends();
+#endif
+    return find_compatible_scan(start == NULL ? subtree : walk_next(start), node_subtree_end(subtree), str);
+}
+
+/* Scratch hash set over a driver's table of compatible strings, used by dtb_match_compatible().
+ * It lives on the stack (queries must not write to the context), so each slot is kept to 4 bytes:
+ * 1024 slots cost 4KiB and hold tables of up to 512 entries. Larger tables are searched directly.
+ */
+struct dtb_match_slot
+{
+    uint16_t index;
+    uint16_t tag; //upper half of the string's hash
+};
+
+struct dtb_match_set
+{
+    const char* const* table;
+    size_t table_count;
+    bool hashed;
+    struct dtb_match_slot slots[MATCH_MAX_SLOTS];
+};
+
+#define MATCH_SLOT_EMPTY ((uint16_t)-1)
+#define MATCH_NONE ((uint32_t)-1)
+
+static size_t match_set_slot(const struct dtb_match_set* set, const char* str, size_t len, uint32_t hash)
+{
+    size_t slot = hash & (MATCH_MAX_SLOTS - 1);
+    while (set->slots[slot].index != MATCH_SLOT_EMPTY)
+    {
+        const struct dtb_match_slot* entry = &set->slots[slot];
+        const char* candidate = set->table[entry->index];
+        if (entry->tag == (uint16_t)(hash >> 16) && strings_eq(candidate, str, len) && candidate[len] == 0)
+            return slot;
+        slot = (slot + 1) & (MATCH_MAX_SLOTS - 1);
+    }
+    return slot;
+}
+
+/* Returns the lowest index of a string in the table, or MATCH_NONE. */
+static uint32_t match_set_find(const struct dtb_match_set* set, const char* str, size_t len, uint32_t hash)
+{
+    if (set->hashed)
+    {
+        const uint16_t index = set->slots[match_set_slot(set, str, len, hash)].index;
+        return index == MATCH_SLOT_EMPTY ? MATCH_NONE : index;
+    }
+
+    for (size_t i = 0; i < set->table_count; i++)
+    {
+        const char* entry = set->table[i];
+        if (entry != NULL && strings_eq(entry, str, len) && entry[len] == 0)
+            return (uint32_t)i;
+    }
+    return MATCH_NONE;
+}
+
+/* Checks a node's compatible strings in order (most specific first) against the table. */
+static uint32_t match_node(dtb_node* node, const struct dtb_match_set* set)
+{
+    dtb_prop* prop = find_known_prop(node, KNOWN_PROP_COMPATIBLE, "compatible");
+    if (prop == NULL)
+        return MATCH_NONE;
+
+    const char* data = prop_data(prop);
+    size_t begin = 0;
+    while (data != NULL && begin < prop_length(prop))
+    {
+        size_t len;
+        const char* str = data + begin;
+        const uint32_t hash = string_hash(str, prop_length(prop) - begin, &len);
+        begin += len + 1;
+
+        const uint32_t index = match_set_find(set, str, len, hash);
+        if (index != MATCH_NONE)
+            return index;
+    }
+
+    return MATCH_NONE;
+}
+
+size_t dtb_match_compatible(const char* const* table, size_t table_count, dtb_match* matches, size_t match_count)
+{
+    if (table == NULL || table_count == 0)
+        return 0;
+
+    struct dtb_match_set set;
+    set.table = table;
+    set.table_count = table_count;
+    set.hashed = table_count <= MATCH_MAX_SLOTS / 2;
+    for (size_t i = 0; set.hashed && i < MATCH_MAX_SLOTS; i++)
+        set.slots[i].index = MATCH_SLOT_EMPTY;
+
+    for (size_t i = 0; set.hashed && i < table_count; i++)
+    {
+        if (table[i] == NULL)
+            continue;
+
+        size_t len;
+        const uint32_t hash = string_hash(table[i], -1ul, &len);
+        const size_t slot = match_set_slot(&set, table[i], len, hash);
+        if (set.slots[slot].index != MATCH_SLOT_EMPTY)
+            continue; //duplicate string, the earlier table entry wins
+
+        set.slots[slot].index = (uint16_t)i;
+        set.slots[slot].tag = (uint16_t)(hash >> 16);
+    }
+
+    /* visit each node once, in the same order that dtb_find_compatible() would */
+    size_t found = 0;
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node))
+    {
+        const uint32_t index = match_node(node, &set);
+        if (index == MATCH_NONE)
+            continue;
+
+        if (matches != NULL && found < match_count)
+        {
+            matches[found].node = node;
+            matches[found].index = index;
+        }
+        found++;
+    }
+
+    return found;
+}
+
+dtb_node* dtb_find_phandle(unsigned handle)
+{
+#ifdef SMOLDTB_LAZY_PARSE
+    /* phandles are indexed as their nodes are expanded, so expand everything before the first lookup */
+    expand_all();
+#endif
+
+    return phandle_index_find(handle);
+}
+
+dtb_atom dtb_intern(const char* name)
+{
+    dtb_atom atom;
+    atom.name = name;
+    atom.exact = false;
+    if (name == NULL || state.strings == NULL)
+        return atom;
+
+    /* Tools that deduplicate the strings block (dtc, libfdt) point every property with the same
+     * name at the first place that name appears, which may be the tail of a longer string.
+     * If the same name appears again as a whole string then the blob wasn't deduplicated,
+     * and comparing addresses isn't enough.
+     */
+    const size_t name_len = string_len(name);
+    size_t begin = 0;
+    while (begin < state.strings_size)
+    {
+        const char* str = state.strings + begin;
+        size_t len = 0;
+        while (begin + len < state.strings_size && str[len] != 0)
+            len++;
+        begin += len + 1;
+
+        if (!atom.exact && len >= name_len && strings_eq(str + len - name_len, name, name_len))
+        {
+            atom.name = str + len - name_len;
+            atom.exact = true;
+        }
+        else if (atom.exact && len == name_len && strings_eq(str, name, name_len))
+        {
+            atom.exact = false;
+            break;
+        }
+    }
+
+    return atom;
+}
+
+static dtb_node* find_child_internal(dtb_node* start, const char* name, size_t name_bounds)
+{
+    expand_node(start);
+
+#ifdef SMOLDTB_PATH_INDEX
+    if (state.path_valid)
+    {
+        if (state.path_count == 0)
+            return NULL;
+
+        size_t len;
+        const uint32_t hash = path_hash(start, string_hash(name, name_bounds, &len));
+        return state.path_table[path_slot(start, name, name_bounds, hash)].child;
+    }
+#endif
+
+    /* If a unit address is given the whole name must match, otherwise it's ignored */
+    bool has_address = false;
+    for (size_t i = 0; i < name_bounds && !has_address; i++)
+        has_address = (name[i] == '@');
+
+    dtb_node* scan = node_child(start);
+    while (scan != NULL)
+    {
+        size_t child_name_len = has_address ? -1ul : string_find_char(node_name(scan), '@');
+        if (child_name_len == -1ul)
+            child_name_len = string_len(node_name(scan));
+
+        if (child_name_len == name_bounds && strings_eq(node_name(scan), name, name_bounds))
+            return scan;
+
+        scan = node_sibling(scan);
+    }
+
+    return NULL;
+}
+
+dtb_node* dtb_find(const char* name)
+{
+    size_t seg_len;
+    dtb_node* scan = state.root;
+    while (scan != NULL)
+    {
+        while (name[0] == '/')
+            name++;
+
+        seg_len = string_find_char(name, '/');
+        if (seg_len == -1ul)
+            seg_len = string_len(name);
+        if (seg_len == 0)
+            return scan;
+
+        scan = find_child_internal(scan, name, seg_len);
+        name += seg_len;
+    }
+
+    return NULL;
+} 
+
+dtb_node* dtb_find_child(dtb_node* start, const char* name)
+{
+    if (start == NULL)
+        return NULL;
+
+    return find_child_internal(start, name, string_len(name));
+}
+
+dtb_prop* dtb_find_prop(dtb_node* node, const char* name)
+{
+    if (node == NULL)
+        return NULL;
+
+    expand_node(node);
+#ifdef SMOLDTB_PROP_SLOTS
+    const size_t slot = known_prop_slot(name);
+    if (slot != KNOWN_PROP_COUNT)
+        return prop_at(node->known_props[slot]);
+#endif
+
+    const size_t name_len = string_len(name);
+    dtb_prop* prop = node_props(node);
+    while (prop)
+    {
+        const size_t prop_name_len = string_len(prop_name(prop));
+        if (prop_name_len == name_len && strings_eq(prop_name(prop), name, prop_name_len))
+            return prop;
+        prop = prop_next(prop);
+    }
+
+    return NULL;
+}
+
+dtb_prop* dtb_find_prop_atom(dtb_node* node, dtb_atom atom)
+{
+    if (node == NULL || atom.name == NULL)
+        return NULL;
+
+    expand_node(node);
+    for (dtb_prop* prop = node_props(node); prop != NULL; prop = prop_next(prop))
+    {
+        if (prop_name(prop) == atom.name)
+            return prop;
+    }
+
+    if (atom.exact)
+        return NULL;
+    return dtb_find_prop(node, atom.name);
+}
+
+dtb_node* dtb_get_sibling(dtb_node* node)
+{
+    if (node == NULL || node_sibling(node) == NULL)
+        return NULL;
+    return node_sibling(node);
+}
+
+dtb_node* dtb_get_child(dtb_node* node)
+{
+    if (node == NULL)
+        return NULL;
+    expand_node(node);
+    return node_child(node);
+}
+
+dtb_node* dtb_get_parent(dtb_node* node)
+{
+    if (node == NULL)
+        return NULL;
+    return node_parent(node);
+}
+
+size_t dtb_get_path(dtb_node* node, char* buff, size_t buff_len)
+{
+    if (node == NULL)
+        return 0;
+
+    /* root nodes have an empty name, so only the separators before each child are counted */
+    size_t path_len = 0;
+    for (dtb_node* scan = node; node_parent(scan) != NULL; scan = node_parent(scan))
+        path_len += string_len(node_name(scan)) + 1;
+    if (path_len == 0)
+        path_len = 1;
+
+    if (buff == NULL || buff_len <= path_len)
+        return path_len;
+
+    /* the path is built backwards, starting with this node's name */
+    size_t end = path_len;
+    buff[end] = 0;
+    buff[0] = '/';
+    for (dtb_node* scan = node; node_parent(scan) != NULL; scan = node_parent(scan))
+    {
+        const size_t name_len = string_len(node_name(scan));
+        end -= name_len;
+        memcpy(buff + end, node_name(scan), name_len);
+        buff[--end] = '/';
+    }
+
+    return path_len;
+}
+
+
+dtb_prop* dtb_get_prop(dtb_node* node, size_t index)
+{
+    dtb_prop_iter iter = dtb_get_prop_iter(node);
+    dtb_prop* prop = dtb_prop_next(&iter);
+    while (prop != NULL && index > 0)
+    {
+        prop = dtb_prop_next(&iter);
+        index--;
+    }
+
+    return prop;
+}
+
+dtb_prop_iter dtb_get_prop_iter(dtb_node* node)
+{
+    dtb_prop_iter iter;
+    iter.next = NULL;
+    if (node == NULL)
+        return iter;
+
+    expand_node(node);
+    iter.next = node_props(node);
+    return iter;
+}
+
+dtb_prop* dtb_prop_next(dtb_prop_iter* iter)
+{
+    if (iter == NULL || iter->next == NULL)
+        return NULL;
+
+    /* advance before returning, so the caller can destroy the returned property */
+    dtb_prop* prop = iter->next;
+    iter->next = prop_next(prop);
+    return prop;
+}
+
+dtb_child_iter dtb_get_child_iter(dtb_node* node)
+{
+    dtb_child_iter iter;
+    iter.next = dtb_get_child(node);
+    return iter;
+}
+
+dtb_node* dtb_child_next(dtb_child_iter* iter)
+{
+    if (iter == NULL || iter->next == NULL)
+        return NULL;
+
+    dtb_node* child = iter->next;
+    iter->next = node_sibling(child);
+    return child;
+}
+
+static size_t get_cells_helper(dtb_node* node, size_t slot, const char* prop_name, size_t orDefault)
+{
+    dtb_prop* prop = find_known_prop(node, slot, prop_name);
+    if (prop == NULL || prop_data(prop) == NULL || prop_length(prop) < FDT_CELL_SIZE)
+        return orDefault;
+
+    return be32(*(const uint32_t*)prop_data(prop));
+}
+
+size_t dtb_get_addr_cells_of(dtb_node* node)
+{
+    return get_cells_helper(node, KNOWN_PROP_ADDR_CELLS, "#address-cells", 2);
+}
+
+size_t dtb_get_size_cells_of(dtb_node* node)
+{
+    return get_cells_helper(node, KNOWN_PROP_SIZE_CELLS, "#size-cells", 1);
+}
+
+size_t dtb_get_addr_cells_for(dtb_node* node)
+{
+    if (node == NULL)
+        return 2;
+    return get_cells_helper(node_parent(node), KNOWN_PROP_ADDR_CELLS, "#address-cells", 2);
+}
+
+size_t dtb_get_size_cells_for(dtb_node* node)
+{
+    if (node == NULL)
+        return 1;
+    return get_cells_helper(node_parent(node), KNOWN_PROP_SIZE_CELLS, "#size-cells", 1);
+}
+
+bool dtb_is_enabled(dtb_node* node)
+{
+    if (node == NULL)
+        return false;
+
+    /* a missing status property means the node is enabled */
+    dtb_prop* status = find_known_prop(node, KNOWN_PROP_STATUS, "status");
+    if (status == NULL)
+        return true;
+
+    const char* str;
+    size_t len;
+    size_t pos = 0;
+    if (!next_prop_string(status, &pos, &str, &len))
+        return false;
+    if (len == 4 && strings_eq(str, "okay", 4))
+        return true;
+    return len == 2 && strings_eq(str, "ok", 2);
+}
+
+bool dtb_is_compatible(dtb_node* node, const char* str)
+{
+    if (node == NULL || str == NULL)
+        return false;
+
+    dtb_prop* compat_prop = find_known_prop(node, KNOWN_PROP_COMPATIBLE, "compatible");
+    if (compat_prop == NULL)
+        return false;
+
+    /* compatible strings must match exactly, "sifive" should not match "sifive,test0" */
+    const size_t str_len = string_len(str);
+    const char* check_str;
+    size_t check_len;
+    size_t pos = 0;
+    while (next_prop_string(compat_prop, &pos, &check_str, &check_len))
+    {
+        if (check_len == str_len && strings_eq(check_str, str, str_len))
+            return true;
+    }
+
+    return false;
+}
+
+bool dtb_stat_node(dtb_node* node, dtb_node_stat* stat)
+{
+    if (node == NULL || stat == NULL)
+        return false;
+
+    stat->name = node_name(node);
+    if (node == state.root)
+        stat->name = ROOT_NODE_STR;
+
+    expand_node(node);
+    stat->prop_count = node->prop_count;
+    stat->child_count = node->child_count;
+    stat->sibling_index = node->sibling_index;
+
+    stat->sibling_count = 0;
+    if (node_parent(node) != NULL)
+        stat->sibling_count = node_parent(node)->child_count;
+
+    return true;
+}
+
+bool dtb_stat_prop(dtb_prop* prop, dtb_prop_stat* stat)
+{
+    if (prop == NULL || stat == NULL)
+        return false;
+
+    stat->name = prop_name(prop);
+    stat->data = prop_data(prop);
+    stat->data_len = prop_length(prop);
+    return true;
+}
+
+size_t dtb_read_resv_memory(size_t entry_count, dtb_reserved_memory* vals)
+{
+    if (entry_count == 0 || vals == NULL)
+        return state.resv_count;
+
+    if (state.resv_count < entry_count)
+        entry_count = state.resv_count;
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        vals[i].base = be64(state.resv_memory[i * 2]);
+        vals[i].length = be64(state.resv_memory[i * 2 + 1]);
+    }
+
+    return entry_count;
+}
+
+/* The memory map is built directly in the caller's buffer, as a sorted list of ranges that
+ * don't overlap. Each range is 'painted' over the ranges already there: it replaces any parts
+ * of them with a lower priority type, and fills the gaps between the rest.
+ */
+struct memory_map
+{
+    dtb_memory_range* ranges;
+    size_t count;
+    size_t max;
+};
+
+static uint64_t memory_range_last(const dtb_memory_range* range)
+{
+    return range->base + (range->length - 1);
+}
+
+static bool memory_map_insert(struct memory_map* map, size_t index, uint64_t base, uint64_t last, uint32_t type)
+{
+    if (map->count == map->max)
+        return false;
+
+    for (size_t i = map->count; i > index; i--)
+        map->ranges[i] = map->ranges[i - 1];
+    map->ranges[index].base = base;
+    map->ranges[index].length = (last - base) + 1;
+    map->ranges[index].type = type;
+    map->count++;
+    return true;
+}
+
+static void memory_map_remove(struct memory_map* map, size_t index)
+{
+    for (size_t i = index + 1; i < map->count; i++)
+        map->ranges[i - 1] = map->ranges[i];
+    map->count--;
+}
+
+static bool memory_map_paint(struct memory_map* map, uint64_t base, uint64_t last, uint32_t type)
+{
+    for (size_t i = 0; i < map->count; i++)
+    {
+        dtb_memory_range* range = &map->ranges[i];
+        const uint64_t range_base = range->base;
+        const uint64_t range_last = memory_range_last(range);
+        if (range->type >= type || range_last < base || range_base > last)
+            continue;
+
+        if (range_base < base && range_last > last)
+        {
+            if (!memory_map_insert(map, i + 1, last + 1, range_last, range->type))
+                return false;
+            map->ranges[i].length = base - range_base;
+            i++;
+        }
+        else if (range_base < base)
+            range->length = base - range_base;
+        else if (range_last > last)
+        {
+            range->base = last + 1;
+            range->length = range_last - last;
+        }
+        else
+            memory_map_remove(map, i--);
+    }
+
+    /* anything still overlapping has the same or a higher priority, so only fill the gaps */
+    size_t i = 0;
+    while (i < map->count && memory_range_last(&map->ranges[i]) < base)
+        i++;
+    uint64_t pos = base;
+    while (true)
+    {
+        if (i < map->count && map->ranges[i].base <= pos)
+        {
+            const uint64_t covered_last = memory_range_last(&map->ranges[i]);
+            if (covered_last >= last)
+                break;
+            pos = covered_last + 1;
+            i++;
+            continue;
+        }
+
+        uint64_t gap_last = last;
+        if (i < map->count && map->ranges[i].base <= last)
+            gap_last = map->ranges[i].base - 1;
+        if (!memory_map_insert(map, i, pos, gap_last, type))
+            return false;
+        if (gap_last == last)
+            break;
+        pos = gap_last + 1;
+        i++;
+    }
+
+    for (size_t j = 1; j < map->count; j++)
+    {
+        dtb_memory_range* prev = &map->ranges[j - 1];
+        if (prev->type == map->ranges[j].type && memory_range_last(prev) + 1 == map->ranges[j].base)
+        {
+            prev->length += map->ranges[j].length;
+            memory_map_remove(map, j--);
+        }
+    }
+
+    return true;
+}
+
+static bool is_memory_node(dtb_node* node)
+{
+    const char* name = node_name(node);
+    if (strings_eq(name, "memory", 6) && (name[6] == 0 || name[6] == '@'))
+        return true;
+
+    dtb_prop* device_type = dtb_find_prop(node, "device_type");
+    size_t pos = 0;
+    const char* str;
+    size_t len;
+    return device_type != NULL && next_prop_string(device_type, &pos, &str, &len)
+        && len == 6 && strings_eq(str, "memory", 6);
+}
+
+/* Calls action for each range that makes up the memory map, or stops early if it returns false.
+ * Returns false if it was stopped.
+ */
+static bool foreach_memory_range(bool (*action)(uint64_t base, uint64_t last, uint32_t type, void* opaque), void* opaque)
+{
+    dtb_pair layout;
+    struct dtb_addr_window window;
+    dtb_child_iter children = dtb_get_child_iter(state.root);
+    for (dtb_node* node = dtb_child_next(&children); node != NULL; node = dtb_child_next(&children))
+    {
+        if (!dtb_is_enabled(node))
+            continue;
+
+        if (is_memory_node(node))
+        {
+            dtb_cell_reader reader = reg_reader(node, &layout);
+            while (next_addr_window(node, &reader, layout, &window))
+            {
+                if (!action(window.base, window.last, SMOLDTB_MEMORY_USABLE, opaque))
+                    return false;
+            }
+            continue;
+        }
+
+        if (!strings_eq(node_name(node), "reserved-memory", sizeof("reserved-memory")))
+            continue;
+
+        /* reservations without a reg are placed by the OS, so there's nothing to add for them */
+        dtb_child_iter regions = dtb_get_child_iter(node);
+        for (dtb_node* region = dtb_child_next(&regions); region != NULL; region = dtb_child_next(&regions))
+        {
+            if (!dtb_is_enabled(region))
+                continue;
+
+            const uint32_t type = dtb_find_prop(region, "no-map") != NULL ? SMOLDTB_MEMORY_NO_MAP : SMOLDTB_MEMORY_RESERVED;
+            dtb_cell_reader reader = reg_reader(region, &layout);
+            while (next_addr_window(region, &reader, layout, &window))
+            {
+                if (!action(window.base, window.last, type, opaque))
+                    return false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < state.resv_count; i++)
+    {
+        const uint64_t base = be64(state.resv_memory[i * 2]);
+        const uint64_t length = be64(state.resv_memory[i * 2 + 1]);
+        if (length == 0)
+            continue;
+
+        uint64_t last = base + (length - 1);
+        if (last < base)
+            last = (uint64_t)-1;
+        if (!action(base, last, SMOLDTB_MEMORY_RESERVED, opaque))
+            return false;
+    }
+
+    return true;
+}
+
+static bool paint_memory_range(uint64_t base, uint64_t last, uint32_t type, void* opaque)
+{
+    return memory_map_paint(opaque, base, last, type);
+}
+
+static bool count_memory_range(uint64_t base, uint64_t last, uint32_t type, void* opaque)
+{
+    (void)base;
+    (void)last;
+    (void)type;
+    (*(size_t*)opaque)++;
+    return true;
+}
+
+size_t dtb_build_memory_map(dtb_memory_range* ranges, size_t max)
+{
+    if (ranges != NULL && max != 0)
+    {
+        struct memory_map map;
+        map.ranges = ranges;
+        map.count = 0;
+        map.max = max;
+        if (foreach_memory_range(paint_memory_range, &map))
+            return map.count;
+    }
+
+    /* each range adds at most two boundaries, and every entry in the map starts at one of them */
+    size_t count = 0;
+    foreach_memory_range(count_memory_range, &count);
+    if (count * 2 <= max)
+        return max + 1;
+    return count * 2;
+}
+
+const char* dtb_read_prop_string(dtb_prop* prop, size_t index)
+{
+    if (prop == NULL)
+        return NULL;
+
+    size_t pos = 0;
+    const char* str;
+    size_t len;
+    for (size_t i = 0; next_prop_string(prop, &pos, &str, &len); i++)
+    {
+        if (i == index)
+            return str;
+    }
+
+    return NULL;
+}
+
+dtb_string_iter dtb_get_string_iter(dtb_prop* prop)
+{
+    dtb_string_iter iter;
+    iter.prop = prop;
+    iter.pos = 0;
+    return iter;
+}
+
+const char* dtb_string_next(dtb_string_iter* iter, size_t* len)
+{
+    if (iter == NULL || iter->prop == NULL)
+        return NULL;
+
+    const char* str;
+    size_t str_len;
+    if (!next_prop_string(iter->prop, &iter->pos, &str, &str_len))
+        return NULL;
+
+    if (len != NULL)
+        *len = str_len;
+    return str;
+}
+
+size_t dtb_find_string_index(dtb_prop* prop, const char* str)
+{
+    if (prop == NULL || str == NULL)
+        return SMOLDTB_STRING_NOT_FOUND;
+
+    const size_t str_len = string_len(str);
+    size_t pos = 0;
+    const char* check_str;
+    size_t check_len;
+    for (size_t i = 0; next_prop_string(prop, &pos, &check_str, &check_len); i++)
+    {
+        if (check_len == str_len && strings_eq(check_str, str, str_len))
+            return i;
+    }
+
+    return SMOLDTB_STRING_NOT_FOUND;
+}
+
+/* Templates for the fixed layout readers declared in smoldtb.h. The cell counts are constants,
+ * so each value is decoded with straight-line code, and uniform layouts use decode_cells().
+ */
+#define READ_CELLS_1(cells) ((smoldtb_value)be32((cells)[0]))
+#define READ_CELLS_2(cells) ((smoldtb_value)(((uint64_t)be32((cells)[0]) << 32) | be32((cells)[1])))
+#define READ_CELLS_3(cells) READ_CELLS_2((cells) + 1)
+
+#define DEFINE_READ_1(x) \
+    size_t dtb_read_prop_1_##x(dtb_prop* prop, smoldtb_value* vals) \
+    { \
+        if (prop == NULL) \
+            return 0; \
+        const size_t count = prop_length(prop) / (x * FDT_CELL_SIZE); \
+        if (vals != NULL) \
+            decode_cells(prop_data(prop), x, count, vals); \
+        return count; \
+    }
+
+#define DEFINE_READ_2(x, y) \
+    size_t dtb_read_prop_2_##x##_##y(dtb_prop* prop, dtb_pair* vals) \
+    { \
+        if (prop == NULL) \
+            return 0; \
+        const uint32_t* cells = prop_data(prop); \
+        const size_t count = prop_length(prop) / ((x + y) * FDT_CELL_SIZE); \
+        if (vals == NULL) \
+            return count; \
+        if (x == y && sizeof(dtb_pair) == 2 * sizeof(smoldtb_value)) \
+            decode_cells(cells, x, count * 2, &vals->a); \
+        else \
+        { \
+            for (size_t i = 0; i < count; i++, cells += x + y) \
+            { \
+                vals[i].a = READ_CELLS_##x(cells); \
+                vals[i].b = READ_CELLS_##y(cells + x); \
+            } \
+        } \
+        return count; \
+    }
+
+#define DEFINE_READ_3(x, y, z) \
+    size_t dtb_read_prop_3_##x##_##y##_##z(dtb_prop* prop, dtb_triplet* vals) \
+    { \
+        if (prop == NULL) \
+            return 0; \
+        const uint32_t* cells = prop_data(prop); \
+        const size_t count = prop_length(prop) / ((x + y + z) * FDT_CELL_SIZE); \
+        if (vals == NULL) \
+            return count; \
+        if (x == y && y == z && sizeof(dtb_triplet) == 3 * sizeof(smoldtb_value)) \
+            decode_cells(cells, x, count * 3, &vals->a); \
+        else \
+        { \
+            for (size_t i = 0; i < count; i++, cells += x + y + z) \
+            { \
+                vals[i].a = READ_CELLS_##x(cells); \
+                vals[i].b = READ_CELLS_##y(cells + x); \
+                vals[i].c = READ_CELLS_##z(cells + x + y); \
+            } \
+        } \
+        return count; \
+    }
+
+SMOLDTB_FIXED_LAYOUTS_1(DEFINE_READ_1)
+SMOLDTB_FIXED_LAYOUTS_2(DEFINE_READ_2)
+SMOLDTB_FIXED_LAYOUTS_3(DEFINE_READ_3)
+
+/* The generic readers hand off to a fixed layout reader if there's one for the requested layout */
+#define DISPATCH_READ_1(x) \
+    if (cell_count == x) \
+        return dtb_read_prop_1_##x(prop, vals);
+#define DISPATCH_READ_2(x, y) \
+    if (layout.a == x && layout.b == y) \
+        return dtb_read_prop_2_##x##_##y(prop, vals);
+#define DISPATCH_READ_3(x, y, z) \
+    if (layout.a == x && layout.b == y && layout.c == z) \
+        return dtb_read_prop_3_##x##_##y##_##z(prop, vals);
+
+size_t dtb_read_prop_1(dtb_prop* prop, size_t cell_count, smoldtb_value* vals)
+{
+    if (prop == NULL || cell_count == 0)
+        return 0;
+
+    SMOLDTB_FIXED_LAYOUTS_1(DISPATCH_READ_1)
+    
+    const size_t count = prop_length(prop) / (cell_count * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    decode_cells(prop_data(prop), cell_count, count, vals);
+    return count;
+}
+
+/* The dtb_pair/triplet/quad structs are arrays of smoldtb_values in all but name, so when
+ * every element uses the same number of cells they can be decoded as one long run.
+ */
+size_t dtb_read_prop_2(dtb_prop* prop, dtb_pair layout, dtb_pair* vals)
+{
+    if (prop == NULL || layout.a == 0 || layout.b == 0)
+        return 0;
+
+    SMOLDTB_FIXED_LAYOUTS_2(DISPATCH_READ_2)
+    
+    const uint32_t* prop_cells = prop_data(prop);
+    const size_t count = prop_length(prop) / ((layout.a + layout.b) * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    if (layout.a == layout.b && sizeof(dtb_pair) == 2 * sizeof(smoldtb_value))
+    {
+        decode_cells(prop_cells, layout.a, count * 2, &vals->a);
+        return count;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint32_t* base = prop_cells + i * (layout.a + layout.b);
+        vals[i].a = extract_cells(base, layout.a);
+        vals[i].b = extract_cells(base + layout.a, layout.b);
+    }
+    return count;
+}
+
+size_t dtb_read_prop_3(dtb_prop* prop, dtb_triplet layout, dtb_triplet* vals)
+{
+    if (prop == NULL || layout.a == 0 || layout.b == 0 || layout.c == 0)
+        return 0;
+
+    SMOLDTB_FIXED_LAYOUTS_3(DISPATCH_READ_3)
+
+    const uint32_t* prop_cells = prop_data(prop);
+    const size_t stride = layout.a + layout.b + layout.c;
+    const size_t count = prop_length(prop) / (stride * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    if (layout.a == layout.b && layout.b == layout.c && sizeof(dtb_triplet) == 3 * sizeof(smoldtb_value))
+    {
+        decode_cells(prop_cells, layout.a, count * 3, &vals->a);
+        return count;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint32_t* base = prop_cells + i * stride;
+        vals[i].a = extract_cells(base, layout.a);
+        vals[i].b = extract_cells(base + layout.a, layout.b);
+        vals[i].c = extract_cells(base + layout.a + layout.b, layout.c);
+    }
+    return count;
+}
+
+size_t dtb_read_prop_4(dtb_prop* prop, dtb_quad layout, dtb_quad* vals)
+{
+    if (prop == NULL || layout.a == 0 || layout.b == 0 || layout.c == 0 || layout.d == 0)
+        return 0;
+
+    const uint32_t* prop_cells = prop_data(prop);
+    const size_t stride = layout.a + layout.b + layout.c + layout.d;
+    const size_t count = prop_length(prop) / (stride * FDT_CELL_SIZE);
+    if (vals == NULL)
+        return count;
+
+    if (layout.a == layout.b && layout.b == layout.c && layout.c == layout.d
+        && sizeof(dtb_quad) == 4 * sizeof(smoldtb_value))
+    {
+        decode_cells(prop_cells, layout.a, count * 4, &vals->a);
+        return count;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint32_t* base = prop_cells + i * stride;
+        vals[i].a = extract_cells(base, layout.a); 
+        vals[i].b = extract_cells(base + layout.a, layout.b);
+        vals[i].c = extract_cells(base + layout.a + layout.b, layout.c);
+        vals[i].d = extract_cells(base + layout.a + layout.b + layout.c, layout.d);
+    }
+    return count;
+}
+
+dtb_cell_reader dtb_get_cell_reader(dtb_prop* prop)
+{
+    dtb_cell_reader reader;
+    reader.cells = NULL;
+    reader.remaining = 0;
+    if (prop == NULL || prop_data(prop) == NULL)
+        return reader;
+
+    reader.cells = prop_data(prop);
+    reader.remaining = prop_length(prop) / FDT_CELL_SIZE;
+    return reader;
+}
+
+/* Checks there's a whole element of 'stride' cells left, and consumes it if there is.
+ * A partial element at the end of a property is never returned, same as dtb_read_prop_*().
+ */
+static const uint32_t* reader_take(dtb_cell_reader* reader, size_t stride)
+{
+    if (reader == NULL || stride == 0 || reader->remaining < stride)
+        return NULL;
+
+    const uint32_t* cells = reader->cells;
+    reader->cells += stride;
+    reader->remaining -= stride;
+    return cells;
+}
+
+/* The reader functions decode one element at a time, straight from the DTB. Passing a NULL
+ * 'val' skips over an element without decoding it.
+ */
+bool dtb_reader_next_value(dtb_cell_reader* reader, size_t cell_count, smoldtb_value* val)
+{
+    const uint32_t* cells = reader_take(reader, cell_count);
+    if (cells == NULL)
+        return false;
+
+    if (val != NULL)
+        *val = extract_cells(cells, cell_count);
+    return true;
+}
+
+bool dtb_reader_next_pair(dtb_cell_reader* reader, dtb_pair layout, dtb_pair* val)
+{
+    if (layout.a == 0 || layout.b == 0)
+        return false;
+    const uint32_t* cells = reader_take(reader, layout.a + layout.b);
+    if (cells == NULL)
+        return false;
+
+    if (val != NULL)
+    {
+        val->a = extract_cells(cells, layout.a);
+        val->b = extract_cells(cells + layout.a, layout.b);
+    }
+    return true;
+}
+
+bool dtb_reader_next_triplet(dtb_cell_reader* reader, dtb_triplet layout, dtb_triplet* val)
+{
+    if (layout.a == 0 || layout.b == 0 || layout.c == 0)
+        return false;
+    const uint32_t* cells = reader_take(reader, layout.a + layout.b + layout.c);
+    if (cells == NULL)
+        return false;
+
+    if (val != NULL)
+    {
+        val->a = extract_cells(cells, layout.a);
+        val->b = extract_cells(cells + layout.a, layout.b);
+        val->c = extract_cells(cells + layout.a + layout.b, layout.c);
+    }
+    return true;
+}
+
+bool dtb_reader_next_quad(dtb_cell_reader* reader, dtb_quad layout, dtb_quad* val)
+{
+    if (layout.a == 0 || layout.b == 0 || layout.c == 0 || layout.d == 0)
+        return false;
+    const uint32_t* cells = reader_take(reader, layout.a + layout.b + layout.c + layout.d);
+    if (cells == NULL)
+        return false;
+
+    if (val != NULL)
+    {
+        val->a = extract_cells(cells, layout.a);
+        val->b = extract_cells(cells + layout.a, layout.b);
+        val->c = extract_cells(cells + layout.a + layout.b, layout.c);
+        val->d = extract_cells(cells + layout.a + layout.b + layout.c, layout.d);
+    }
+    return true;
+}
+
+/* Maps an address on a bus to the address space of the bus's parent. Returns false if
+ * the bus has no 'ranges' property, or none of its ranges contain the address.
+ */
+static bool translate_through(dtb_node* bus, smoldtb_value* addr)
+{
+#ifdef SMOLDTB_RANGES_CACHE
+    const struct dtb_ranges_entry* entry = ranges_cache_find(bus);
+    if (entry != NULL)
+    {
+        size_t low = 0;
+        size_t high = entry->count;
+        if (entry->sorted)
+        {
+            /* the ranges don't overlap, so only the last one starting at or below addr can match */
+            while (low < high)
+            {
+                const size_t mid = low + (high - low) / 2;
+                if (entry->ranges[mid].a <= *addr)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            high = low;
+            low = (low != 0) ? low - 1 : 0;
+        }
+
+        for (size_t i = low; i < high; i++)
+        {
+            const dtb_triplet* range = &entry->ranges[i];
+            if (*addr - range->a < range->c)
+            {
+                *addr = range->b + (*addr - range->a);
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+
+    dtb_prop* ranges = find_known_prop(bus, KNOWN_PROP_RANGES, "ranges");
+    if (ranges == NULL || !ranges_addrs_fit(bus))
+        return false;
+    if (prop_length(ranges) == 0)
+        return true; /* an empty ranges property means the address spaces are the same */
+
+    dtb_triplet layout;
+    layout.a = dtb_get_addr_cells_of(bus);
+    layout.b = dtb_get_addr_cells_of(node_parent(bus));
+    layout.c = dtb_get_size_cells_of(bus);
+
+    dtb_cell_reader reader = dtb_get_cell_reader(ranges);
+    dtb_triplet range;
+    while (dtb_reader_next_triplet(&reader, layout, &range))
+    {
+        if (*addr - range.a < range.c)
+        {
+            *addr = range.b + (*addr - range.a);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool dtb_translate_address(dtb_node* node, smoldtb_value bus_addr, smoldtb_value* cpu_addr)
+{
+    if (node == NULL || cpu_addr == NULL)
+        return false;
+
+    /* the root node's children are already in the cpu's address space */
+    dtb_node* bus = node_parent(node);
+    while (bus != NULL && node_parent(bus) != NULL)
+    {
+        if (!translate_through(bus, &bus_addr))
+            return false;
+        bus = node_parent(bus);
+    }
+
+    *cpu_addr = bus_addr;
+    return true;
+}
+
+size_t dtb_read_reg_translated(dtb_node* node, dtb_pair* vals)
+{
+    if (node == NULL)
+        return 0;
+
+    dtb_pair layout;
+    layout.a = dtb_get_addr_cells_for(node);
+    layout.b = dtb_get_size_cells_for(node);
+    dtb_prop* reg = find_known_prop(node, KNOWN_PROP_REG, "reg");
+    if (vals == NULL)
+        return dtb_read_prop_2(reg, layout, NULL);
+
+    const size_t count = dtb_read_prop_2(reg, layout, vals);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!dtb_translate_address(node, vals[i].a, &vals[i].a))
+            return i;
+    }
+    return count;
+}
+
+/* Builds the key for a nexus from the child's unit address and interrupt specifier, and looks
+ * it up in the nexus's interrupt-map. Unit addresses shorter than the nexus expects are padded
+ * with zeroes.
+ */
+static bool irq_map_lookup(dtb_node* node, const uint32_t* addr, size_t addr_count, const uint32_t* spec, struct dtb_irq_map_entry* found)
+{
+    struct dtb_irq_nexus local_nexus;
+    const struct dtb_irq_nexus* nexus = NULL;
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+    nexus = irq_nexus_find(node);
+#endif
+    if (nexus == NULL)
+    {
+        if (!read_irq_nexus(node, &local_nexus))
+            return false;
+        nexus = &local_nexus;
+    }
+
+    uint32_t key[IRQ_KEY_CELLS];
+    for (size_t i = 0; i < nexus->addr_cells; i++)
+        key[i] = (i < addr_count ? addr[i] : 0) & nexus->mask[i];
+    for (size_t i = 0; i < nexus->spec_cells; i++)
+        key[nexus->addr_cells + i] = spec[i] & nexus->mask[nexus->addr_cells + i];
+    const size_t key_cells = nexus->addr_cells + nexus->spec_cells;
+
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+    if (nexus != &local_nexus)
+    {
+        const uint32_t hash = irq_map_hash(node, key, key_cells);
+        const size_t mask = state.irq_map_capacity - 1;
+        for (size_t slot = hash & mask; state.irq_map_table[slot].nexus != NULL; slot = (slot + 1) & mask)
+        {
+            const struct dtb_irq_map_entry* entry = &state.irq_map_table[slot];
+            if (entry->nexus == node && entry->hash == hash && irq_keys_eq(entry->key, key, key_cells))
+            {
+                *found = *entry;
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+
+    const uint32_t* cells;
+    const uint32_t* end;
+    if (!irq_map_span(node, &cells, &end))
+        return false;
+    while (next_irq_map_entry(nexus, &cells, end, found))
+    {
+        if (irq_keys_eq(found->key, key, key_cells))
+            return true;
+    }
+    return false;
+}
+
+/* Walks up the interrupt tree from ipar, translating the specifier through any nexus nodes,
+ * until reaching an interrupt controller.
+ */
+static bool resolve_interrupt(dtb_node* ipar, const uint32_t* addr, size_t addr_count, const uint32_t* spec, size_t spec_cells, dtb_interrupt* out)
+{
+    uint32_t curr_addr[IRQ_ADDR_CELLS];
+    uint32_t curr_spec[SMOLDTB_MAX_INTERRUPT_CELLS];
+    for (size_t i = 0; i < addr_count; i++)
+        curr_addr[i] = addr[i];
+    for (size_t i = 0; i < spec_cells; i++)
+        curr_spec[i] = spec[i];
+
+    for (size_t depth = 0; depth < IRQ_MAX_DEPTH && ipar != NULL; depth++)
+    {
+        if (read_cell_prop(ipar, "#interrupt-cells", -1ul) != spec_cells)
+            return false;
+
+        /* an interrupt-map takes priority, as some nexus nodes are also marked as controllers */
+        if (dtb_find_prop(ipar, "interrupt-map") == NULL)
+        {
+            if (dtb_find_prop(ipar, "interrupt-controller") != NULL)
+            {
+                out->controller = ipar;
+                out->cell_count = spec_cells;
+                for (size_t i = 0; i < spec_cells; i++)
+                    out->cells[i] = curr_spec[i];
+                return true;
+            }
+
+            ipar = find_interrupt_parent(ipar);
+            continue;
+        }
+
+        struct dtb_irq_map_entry entry;
+        if (!irq_map_lookup(ipar, curr_addr, addr_count, curr_spec, &entry))
+            return false;
+
+        ipar = entry.parent;
+        addr_count = entry.parent_addr_cells;
+        spec_cells = entry.parent_spec_cells;
+        for (size_t i = 0; i < addr_count; i++)
+            curr_addr[i] = entry.parent_addr[i];
+        for (size_t i = 0; i < spec_cells; i++)
+            curr_spec[i] = entry.parent_spec[i];
+    }
+
+    return false;
+}
+
+/* Resolves one specifier from the node's own properties, and adds it to the output if there's space.
+ * Interrupts that can't be resolved are still added (with no controller), so indices match interrupt-names.
+ */
+static void add_resolved_interrupt(dtb_node* ipar, const uint32_t* addr, size_t addr_count, const uint32_t* be_spec, size_t spec_cells, dtb_interrupt* out, size_t max, size_t* count)
+{
+    uint32_t spec[SMOLDTB_MAX_INTERRUPT_CELLS];
+    for (size_t i = 0; i < spec_cells; i++)
+        spec[i] = be32(be_spec[i]);
+
+    if (out != NULL && *count < max)
+    {
+        dtb_interrupt* irq = &out[*count];
+        if (!resolve_interrupt(ipar, addr, addr_count, spec, spec_cells, irq))
+        {
+            irq->controller = NULL;
+            irq->cell_count = spec_cells;
+            for (size_t i = 0; i < spec_cells; i++)
+                irq->cells[i] = spec[i];
+        }
+    }
+    (*count)++;
+}
+
+size_t dtb_resolve_interrupts(dtb_node* node, dtb_interrupt* out, size_t max)
+{
+    if (node == NULL)
+        return 0;
+
+    /* the unit address is only needed if the interrupts pass through an interrupt-map */
+    uint32_t addr[IRQ_ADDR_CELLS];
+    size_t addr_count = 0;
+    dtb_prop* reg = find_known_prop(node, KNOWN_PROP_REG, "reg");
+    if (reg != NULL && prop_data(reg) != NULL)
+    {
+        const uint32_t* reg_cells = prop_data(reg);
+        addr_count = dtb_get_addr_cells_for(node);
+        if (addr_count > prop_length(reg) / FDT_CELL_SIZE)
+            addr_count = prop_length(reg) / FDT_CELL_SIZE;
+        if (addr_count > IRQ_ADDR_CELLS)
+            addr_count = IRQ_ADDR_CELLS;
+        for (size_t i = 0; i < addr_count; i++)
+            addr[i] = be32(reg_cells[i]);
+    }
+
+    size_t count = 0;
+    const uint32_t* cells;
+    const uint32_t* end;
+    dtb_prop* extended = dtb_find_prop(node, "interrupts-extended");
+    if (extended != NULL && prop_data(extended) != NULL)
+    {
+        /* each entry is a phandle to the interrupt parent, followed by its specifier */
+        cells = prop_data(extended);
+        end = cells + prop_length(extended) / FDT_CELL_SIZE;
+        while (cells < end)
+        {
+            dtb_node* ipar = dtb_find_phandle(be32(*cells));
+            cells++;
+            const size_t spec_cells = read_cell_prop(ipar, "#interrupt-cells", -1ul);
+            if (ipar == NULL || spec_cells > SMOLDTB_MAX_INTERRUPT_CELLS || (size_t)(end - cells) < spec_cells)
+                break;
+
+            add_resolved_interrupt(ipar, addr, addr_count, cells, spec_cells, out, max, &count);
+            cells += spec_cells;
+        }
+        return count;
+    }
+
+    dtb_prop* interrupts = find_known_prop(node, KNOWN_PROP_INTERRUPTS, "interrupts");
+    if (interrupts == NULL || prop_data(interrupts) == NULL)
+        return 0;
+
+    dtb_node* ipar = find_interrupt_parent(node);
+    const size_t spec_cells = read_cell_prop(ipar, "#interrupt-cells", -1ul);
+    if (ipar == NULL || spec_cells == 0 || spec_cells > SMOLDTB_MAX_INTERRUPT_CELLS)
+        return 0;
+
+    cells = prop_data(interrupts);
+    end = cells + prop_length(interrupts) / FDT_CELL_SIZE;
+    for (; (size_t)(end - cells) >= spec_cells; cells += spec_cells)
+        add_resolved_interrupt(ipar, addr, addr_count, cells, spec_cells, out, max, &count);
+    return count;
+}
+
+dtb_node* dtb_find_by_address(smoldtb_value addr)
+{
+#ifdef SMOLDTB_ADDRESS_INDEX
+    dtb_node* found;
+    if (find_by_address_indexed(addr, &found))
+        return found;
+#endif
+
+    struct dtb_addr_window best;
+    best.node = NULL;
+    size_t order = 0;
+    for (dtb_node* node = state.root; node != NULL; node = walk_next(node), order++)
+    {
+        dtb_pair layout;
+        dtb_cell_reader reader = reg_reader(node, &layout);
+        struct dtb_addr_window window;
+        while (next_addr_window(node, &reader, layout, &window))
+        {
+            window.order = order;
+            if (addr < window.base || addr > window.last)
+                continue;
+            if (best.node == NULL || addr_window_better(&window, &best))
+                best = window;
+        }
+    }
+
+    return best.node;
+}
+
+#ifdef SMOLDTB_ENABLE_WRITE_API
+/* ---- Section: Writable-Mode Private Functions ---- */
+
+struct finalise_data
+{
+    uint32_t* struct_buf;
+    char* string_buf;
+    size_t struct_ptr;
+    size_t string_ptr;
+    size_t struct_buf_size;
+    size_t string_buf_size;
+    bool print_success;
+};
+
+struct name_collision_check
+{
+    const char* name;
+    size_t name_len;
+    bool collision;
+};
+
+static void phandle_index_remove(uint32_t handle, dtb_node* node)
+{
+    if (state.phandle_count == 0)
+        return;
+
+    const size_t mask = state.phandle_capacity - 1;
+    size_t slot = phandle_slot(handle);
+    while (node_at(state.phandles[slot].node) != NULL && state.phandles[slot].handle != handle)
+        slot = (slot + 1) & mask;
+    if (node_at(state.phandles[slot].node) != node || node == NULL)
+        return;
+
+    /* Backward shift deletion: move later entries of the probe sequence into the hole, if
+     * the hole lies between their home slot and where they currently are.
+     */
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; node_at(state.phandles[next].node) != NULL; next = (next + 1) & mask)
+    {
+        const size_t home = phandle_slot(state.phandles[next].handle);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            state.phandles[hole] = state.phandles[next];
+            hole = next;
+        }
+    }
+
+    state.phandles[hole].node = ref_node(NULL);
+    state.phandle_count--;
+}
+
+/* Undoes check_for_special_prop(), should be run before a property is modified or destroyed. */
+static void forget_special_prop(dtb_node* node, dtb_prop* prop)
+{
+#ifdef SMOLDTB_PROP_SLOTS
+    const size_t slot = known_prop_slot(prop_name(prop));
+    if (slot != KNOWN_PROP_COUNT && prop_at(node->known_props[slot]) == prop)
+        node->known_props[slot] = ref_prop(NULL);
+#endif
+
+    uint32_t handle;
+    if (is_phandle_prop(prop) && read_phandle(prop, &handle))
+        phandle_index_remove(handle, node);
+
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    /* the index isn't patched in place, searches go back to walking the tree instead */
+    if (is_compatible_prop(prop))
+        state.compat_valid = false;
+#endif
+#if defined(SMOLDTB_RANGES_CACHE) || defined(SMOLDTB_INTERRUPT_MAP_CACHE) || defined(SMOLDTB_ADDRESS_INDEX)
+    const char* name = prop_name(prop);
+#endif
+#ifdef SMOLDTB_RANGES_CACHE
+    /* the cached tables depend on the cell counts of buses as well as their ranges */
+    if (strings_eq(name, "ranges", sizeof("ranges")) || strings_eq(name, "#address-cells", sizeof("#address-cells"))
+        || strings_eq(name, "#size-cells", sizeof("#size-cells")))
+        state.ranges_valid = false;
+#endif
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+    /* entries store the parent's node and cell counts, so a change to any of these affects them */
+    if (strings_eq(name, "interrupt-map", sizeof("interrupt-map")) || strings_eq(name, "interrupt-map-mask", sizeof("interrupt-map-mask"))
+        || strings_eq(name, "#interrupt-cells", sizeof("#interrupt-cells")) || strings_eq(name, "#address-cells", sizeof("#address-cells"))
+        || is_phandle_prop(prop))
+        state.irq_map_valid = false;
+#endif
+#ifdef SMOLDTB_ADDRESS_INDEX
+    if (strings_eq(name, "reg", sizeof("reg")) || strings_eq(name, "ranges", sizeof("ranges"))
+        || strings_eq(name, "#address-cells", sizeof("#address-cells")) || strings_eq(name, "#size-cells", sizeof("#size-cells")))
+        state.addr_valid = false;
+#endif
+}
+
+/* Memory for anything created by the write API. Compact builds can only link to nodes and
+ * properties inside the static buffer, so they come from the same arenas as parsed ones and (like
+ * names and data) aren't reclaimed until the next dtb_init(), unless they were the most
+ * recent allocation (see buff_free()).
+ */
+static void* write_alloc(size_t length)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return buff_alloc(length);
+#else
+    return try_malloc(length);
+#endif
+}
+
+static void write_free(void* ptr, size_t length)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    buff_free(ptr, length);
+#else
+    try_free(ptr, length);
+#endif
+}
+
+static dtb_node* alloc_write_node()
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return arena_alloc(&state.node_arena, 0);
+#else
+    dtb_node* node = try_malloc(sizeof(dtb_node));
+    if (node != NULL)
+        node->fromMalloc = true;
+    return node;
+#endif
+}
+
+static void free_write_node(dtb_node* node)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    (void)node;
+#else
+    if (node->fromMalloc)
+        try_free(node, sizeof(dtb_node));
+#endif
+}
+
+static dtb_prop* alloc_write_prop()
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return arena_alloc(&state.prop_arena, 0);
+#else
+    dtb_prop* prop = try_malloc(sizeof(dtb_prop));
+    if (prop != NULL)
+    {
+        prop->length = 0;
+        prop->fromMalloc = true;
+        prop->dataFromMalloc = false;
+    }
+    return prop;
+#endif
+}
+
+static void free_write_prop(dtb_prop* prop)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    (void)prop;
+#else
+    if (prop->fromMalloc)
+        try_free(prop, sizeof(dtb_prop));
+#endif
+}
+
+static bool prop_owns_data(const dtb_prop* prop)
+{
+#ifdef SMOLDTB_COMPACT_NODES
+    return (prop->data & REF_IN_BUFF) != 0;
+#else
+    return prop->dataFromMalloc;
+#endif
+}
+
+static void free_prop_data(dtb_prop* prop)
+{
+    if (!prop_owns_data(prop))
+        return;
+
+#ifdef SMOLDTB_COMPACT_NODES
+    struct fdt_property* header = prop_data(prop);
+    write_free(header - 1, sizeof(struct fdt_property) + prop_length(prop));
+#else
+    write_free(prop_data(prop), prop_length(prop));
+#endif
+}
+
+static int destroy_props(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    (void)opaque;
+
+    forget_special_prop(node, prop);
+    free_prop_data(prop);
+    free_write_prop(prop);
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static void destroy_dead_node(dtb_node* node)
+{
+    if (node == NULL || node_parent(node) != NULL)
+        return;
+
+    while (node_child(node) != NULL)
+    {
+        dtb_node* deletee = node_child(node);
+        node->child = deletee->sibling;
+
+        deletee->parent = ref_node(NULL);
+        destroy_dead_node(deletee);
+    }
+
+    do_foreach_prop(node, destroy_props, NULL);
+    free_write_node(node);
+}
+
+static int init_finalise_data_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    (void)node;
+    if (node == NULL || prop == NULL)
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    struct finalise_data* data = opaque;
+    data->struct_buf_size += 3; /* +1 for FDT_PROP token, +2 for prop description struct */
+    data->struct_buf_size += dtb_align_up(prop_length(prop), FDT_CELL_SIZE) / FDT_CELL_SIZE;
+    data->string_buf_size += string_len(prop_name(prop)) + 1; /* +1 for null terminator */
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static int init_finalise_data(dtb_node* node, void* opaque)
+{
+    if (node == NULL)
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    struct finalise_data* data = opaque;
+    expand_node(node);
+    data->struct_buf_size += 2; /* +1 for BEGIN_NODE token, +1 for END_NODE token */
+    data->struct_buf_size += dtb_align_up(string_len(node_name(node)) + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE; /* +1 for null terminator */
+
+    do_foreach_prop(node, init_finalise_data_prop, opaque);
+    do_foreach_sibling(node_child(node), init_finalise_data, opaque);
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static int print_prop(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    (void)node;
+    struct finalise_data* data = opaque;
+
+    const uint32_t name_offset = data->string_ptr;
+    const size_t name_len = string_len(prop_name(prop));
+    if (data->string_ptr + name_len + 1 > data->string_buf_size) /* bounds check */
+    {
+        data->print_success = false;
+        return SMOLDTB_FOREACH_ABORT;
+    }
+
+    memcpy(data->string_buf + data->string_ptr, prop_name(prop), name_len);
+    data->string_buf[data->string_ptr + name_len] = 0;
+    data->string_ptr += name_len + 1; /* +1 for null terminator */
+
+    const size_t data_cells = dtb_align_up(prop_length(prop), FDT_CELL_SIZE) / FDT_CELL_SIZE;
+    if (data->struct_ptr + 3 + data_cells > data->struct_buf_size) /* bounds check */
+    {
+        data->print_success = false;
+        return SMOLDTB_FOREACH_ABORT;
+    }
+
+    data->struct_buf[data->struct_ptr++] = be32(FDT_PROP);
+    data->struct_buf[data->struct_ptr++] = be32((uint32_t)prop_length(prop));
+    data->struct_buf[data->struct_ptr++] = be32(name_offset);
+
+    uint32_t* prop_cells = prop_data(prop);
+    for (size_t i = 0; i < data_cells; i++)
+        data->struct_buf[data->struct_ptr++] = prop_cells[i];
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static int print_node(dtb_node* node, void* opaque)
+{
+    struct finalise_data* data = opaque;
+    const size_t name_len = string_len(node_name(node));
+    const size_t name_cells = dtb_align_up(name_len + 1, FDT_CELL_SIZE) / FDT_CELL_SIZE;
+
+    if (data->struct_ptr + 1 + name_cells > data->struct_buf_size) /* bounds check */
+    {
+        data->print_success = false;
+        return SMOLDTB_FOREACH_ABORT;
+    }
+
+    data->struct_buf[data->struct_ptr++] = be32(FDT_BEGIN_NODE);
+
+    uint8_t* name_buf = (uint8_t*)(data->struct_buf + data->struct_ptr);
+    memcpy(name_buf, node_name(node), name_len);
+    name_buf[name_len] = 0;
+    data->struct_ptr += name_cells;
+
+    do_foreach_prop(node, print_prop, opaque);
+    if (!data->print_success)
+        return SMOLDTB_FOREACH_ABORT;
+    do_foreach_sibling(node_child(node), print_node, opaque);
+    if (!data->print_success)
+        return SMOLDTB_FOREACH_ABORT;
+
+    if (data->struct_ptr + 1 > data->struct_buf_size) /* bounds check */
+    {
+        data->print_success = false;
+        return SMOLDTB_FOREACH_ABORT;
+    }
+    data->struct_buf[data->struct_ptr++] = be32(FDT_END_NODE);
+
+    return SMOLDTB_FOREACH_CONTINUE;
+}
+
+static int check_sibling_name_collisions(dtb_node* node, void* opaque)
+{
+    struct name_collision_check* check = opaque;
+
+    if (!strings_eq(node_name(node), check->name, check->name_len))
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    check->collision = true;
+    return SMOLDTB_FOREACH_ABORT;
+}
+
+static int check_prop_name_collisions(dtb_node* node, dtb_prop* prop, void* opaque)
+{
+    (void)node;
+    struct name_collision_check* check = opaque;
+
+    if (!strings_eq(prop_name(prop), check->name, check->name_len))
+        return SMOLDTB_FOREACH_CONTINUE;
+
+    check->collision = true;
+    return SMOLDTB_FOREACH_ABORT;
+}
+
+/* ---- Section: Writable-Mode Public API ---- */
+
+size_t dtb_finalise_to_buffer(void* buffer, size_t buffer_size, uint32_t boot_cpu_id, dtb_reserved_memory* resv, size_t resv_count)
+{
+    struct finalise_data final_data;
+    final_data.struct_buf_size = 0;
+    final_data.string_buf_size = 1; /* we'll use 1 byte for the empty string */
+
+    do_foreach_sibling(state.root, init_finalise_data, &final_data);
+    const size_t reserved_block_size = (resv_count + 1) * sizeof(dtb_reserved_memory);
+    const size_t struct_buf_bytes = final_data.struct_buf_size * FDT_CELL_SIZE;
+    const size_t total_bytes = final_data.string_buf_size + struct_buf_bytes + 
+        sizeof(struct fdt_header) + reserved_block_size;
+
+    if (buffer == NULL || total_bytes < buffer_size)
+        return total_bytes;
+    if ((uintptr_t)buffer & 0b11)
+        return SMOLDTB_FINALISE_FAILURE; /* check buffer is aligned to a 32-bit boundary */
+
+    struct fdt_header* header = (struct fdt_header*)buffer;
+    header->magic = be32(FDT_MAGIC);
+    header->total_size = be32(total_bytes);
+    header->offset_structs = be32(sizeof(struct fdt_header) + reserved_block_size);
+    header->offset_strings = be32(be32(header->offset_structs) + struct_buf_bytes);
+    header->offset_memmap_rsvd = be32(sizeof(struct fdt_header));
+    header->version = be32(FDT_VERSION);
+    header->last_comp_version = be32(16); /* as per spec, this field must be 16. */
+    header->boot_cpu_id = be32(boot_cpu_id);
+    header->size_strings = be32(final_data.string_buf_size);
+    header->size_structs = be32(struct_buf_bytes);
+
+    uint64_t* reserved_block = (uint64_t*)(header + 1);
+    for (size_t i = 0; i < resv_count; i++)
+    {
+        reserved_block[i * 2 + 0] = be64(resv[i].base);
+        reserved_block[i * 2 + 1] = be64(resv[i].length);
+    }
+    reserved_block[resv_count * 2 + 0] = 0;
+    reserved_block[resv_count * 2 + 1] = 0;
+
+    final_data.struct_buf = (uint32_t*)((uintptr_t)buffer + be32(header->offset_structs));
+    final_data.string_buf = (char*)((uintptr_t)buffer + be32(header->offset_strings));
+    final_data.struct_ptr = 0;
+    final_data.string_ptr = 1;
+    final_data.string_buf[0] = 0;
+
+    final_data.print_success = true;
+    do_foreach_sibling(state.root, print_node, &final_data);
+    return final_data.print_success ? total_bytes : SMOLDTB_FINALISE_FAILURE;
+}
+
+dtb_node* dtb_find_or_create_node(const char* path)
+{
+    if (path == NULL)
+        return NULL;
+
+    size_t seg_len;
+    dtb_node* scan = state.root;
+    while (scan != NULL)
+    {
+        while (path[0] == '/')
+            path++;
+
+        seg_len = string_find_char(path, '/');
+        if (seg_len == -1ul)
+            seg_len = string_len(path);
+        if (seg_len == 0)
+            return scan;
+
+        dtb_node* next = find_child_internal(scan, path, seg_len);
+        if (next == NULL)
+            next = dtb_create_child(scan, path);
+        scan = next;
+    }
+
+    return NULL;
+}
+
+dtb_prop* dtb_find_or_create_prop(dtb_node* node, const char* name)
+{
+    if (node == NULL || name == NULL)
+        return NULL;
+
+    dtb_prop* prop = dtb_find_prop(node, name);
+    if (prop == NULL)
+        prop = dtb_create_prop(node, name);
+    return prop;
+}
+
+dtb_node* dtb_create_sibling(dtb_node* node, const char* name)
+{
+    if (node == NULL || name == NULL || node_parent(node) == NULL) /* creating siblings of root node is disallowed */
+        return NULL;
+
+    struct name_collision_check check_data;
+    check_data.collision = false;
+    check_data.name = name;
+    check_data.name_len = string_len(name);
+    if (string_find_char(name, '/') < check_data.name_len)
+        check_data.name_len = string_find_char(name, '/');
+
+    do_foreach_sibling(node_child(node_parent(node)), check_sibling_name_collisions, &check_data);
+    if (check_data.collision)
+    {
+        LOG_ERROR("Failed to create node with duplicate name.");
+        return NULL;
+    }
+
+    const size_t name_len = string_len(name);
+    char* name_buf = write_alloc(name_len + 1);
+    if (name_buf == NULL)
+        return NULL;
+    memcpy(name_buf, name, name_len);
+    name_buf[name_len] = 0;
+
+    dtb_node* sibling = alloc_write_node();
+    if (sibling == NULL)
+    {
+        LOG_ERROR("Failed to allocate node for sibling.");
+        return NULL;
+    }
+
+    sibling->name = ref_str(name_buf);
+    sibling->parent = node->parent;
+    sibling->child = ref_node(NULL);
+    sibling->props = ref_prop(NULL);
+#ifdef SMOLDTB_LAZY_PARSE
+    sibling->expanded = true;
+#endif
+#ifdef SMOLDTB_PROP_SLOTS
+    for (size_t i = 0; i < KNOWN_PROP_COUNT; i++)
+        sibling->known_props[i] = ref_prop(NULL);
+#endif
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    sibling->compat = NULL;
+    sibling->compat_count = 0;
+#endif
+
+    sibling->subtree_end = ref_node(NULL);
+    sibling->sibling = node->sibling;
+    node->sibling = ref_node(sibling);
+
+    sibling->child_count = 0;
+    sibling->prop_count = 0;
+    sibling->sibling_index = node->sibling_index + 1;
+    node_parent(node)->child_count++;
+    for (dtb_node* later = node_sibling(sibling); later != NULL; later = node_sibling(later))
+        later->sibling_index++;
+
+    state.subtree_ends_dirty = true;
+#ifdef SMOLDTB_PATH_INDEX
+    state.path_valid = false; //new nodes aren't added to the path index
+#endif
+    return sibling;
+}
+
+dtb_node* dtb_create_child(dtb_node* node, const char* name)
+{
+    if (node == NULL || name == NULL)
+        return NULL;
+
+    struct name_collision_check check_data;
+    check_data.collision = false;
+    check_data.name = name;
+    check_data.name_len = string_len(name);
+    if (string_find_char(name, '/') < check_data.name_len)
+        check_data.name_len = string_find_char(name, '/');
+
+    expand_node(node);
+    do_foreach_sibling(node_child(node), check_sibling_name_collisions, &check_data);
+    if (check_data.collision)
+    {
+        LOG_ERROR("Failed to create node with duplicate name.");
+        return NULL;
+    }
+
+    const size_t name_len = string_len(name);
+    char* name_buf = write_alloc(name_len + 1);
+    if (name_buf == NULL)
+        return NULL;
+    memcpy(name_buf, name, name_len);
+    name_buf[name_len] = 0;
+
+    dtb_node* child = alloc_write_node();
+    if (child == NULL)
+    {
+        LOG_ERROR("Failed to allocate node for child.");
+        return NULL;
+    }
+
+    child->parent = ref_node(node);
+    child->child = ref_node(NULL);
+    child->props = ref_prop(NULL);
+    child->name = ref_str(name_buf);
+#ifdef SMOLDTB_LAZY_PARSE
+    child->expanded = true;
+#endif
+#ifdef SMOLDTB_PROP_SLOTS
+    for (size_t i = 0; i < KNOWN_PROP_COUNT; i++)
+        child->known_props[i] = ref_prop(NULL);
+#endif
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    child->compat = NULL;
+    child->compat_count = 0;
+#endif
+    child->subtree_end = ref_node(NULL);
+    child->sibling = ref_node(NULL);
+    child->child_count = 0;
+    child->prop_count = 0;
+    child->sibling_index = node->child_count++;
+
+    /* new children go at the end of the list, after any existing ones */
+    dtb_node* last = node_child(node);
+    if (last == NULL)
+        node->child = ref_node(child);
+    else
+    {
+        while (node_sibling(last) != NULL)
+            last = node_sibling(last);
+        last->sibling = ref_node(child);
+    }
+
+    state.subtree_ends_dirty = true;
+#ifdef SMOLDTB_PATH_INDEX
+    state.path_valid = false; //new nodes aren't added to the path index
+#endif
+    return child;
+}
+
+dtb_prop* dtb_create_prop(dtb_node* node, const char* name)
+{
+    if (node == NULL || name == NULL)
+        return NULL;
+
+    const size_t name_len = string_len(name);
+    struct name_collision_check check_data;
+    check_data.collision = false;
+    check_data.name = name;
+    check_data.name_len = name_len;
+
+    do_foreach_prop(node, check_prop_name_collisions, &check_data);
+    if (check_data.collision)
+    {
+        LOG_ERROR("Failed to create prop with duplicate name.");
+        return NULL;
+    }
+
+    /* reuse the name from the strings block if it's there, so atoms can find this property */
+    const char* name_buf = dtb_intern(name).name;
+    if (name_buf == name)
+    {
+        char* name_copy = write_alloc(name_len + 1);
+        if (name_copy == NULL)
+            return NULL;
+        memcpy(name_copy, name, name_len);
+        name_copy[name_len] = 0;
+        name_buf = name_copy;
+    }
+
+    dtb_prop* prop = alloc_write_prop();
+    if (prop == NULL)
+    {
+        LOG_ERROR("Failed to allocate property");
+        return NULL;
+    }
+
+    prop->data = ref_data(NULL);
+    prop->name = ref_str(name_buf);
+    prop->next = ref_prop(NULL);
+    prop->node = ref_node(node);
+
+    dtb_prop* last = node_props(node);
+    if (last == NULL)
+        node->props = ref_prop(prop);
+    else
+    {
+        while (prop_next(last) != NULL)
+            last = prop_next(last);
+        last->next = ref_prop(prop);
+    }
+    node->prop_count++;
+#ifdef SMOLDTB_PROP_SLOTS
+    const size_t slot = known_prop_slot(prop_name(prop));
+    if (slot != KNOWN_PROP_COUNT)
+        node->known_props[slot] = ref_prop(prop);
+#endif
+    return prop;
+}
+
+bool dtb_destroy_node(dtb_node* node)
+{
+    if (node == NULL)
+        return false;
+
+    state.subtree_ends_dirty = true;
+#ifdef SMOLDTB_PATH_INDEX
+    state.path_valid = false; //the index isn't updated, dtb_find() goes back to walking the tree
+#endif
+#ifdef SMOLDTB_RANGES_CACHE
+    state.ranges_valid = false; //the node may be a bus, and its address could be reused
+#endif
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+    state.irq_map_valid = false;
+#endif
+#ifdef SMOLDTB_ADDRESS_INDEX
+    state.addr_valid = false;
+#endif
+
+    dtb_node* parent = node_parent(node);
+    if (parent != NULL) /* break linkage in parents list of child nodes */
+    {
+        dtb_node* scan = node_child(parent);
+        if (scan == node)
+        {
+            scan = NULL;
+            parent->child = node->sibling;
+        }
+
+        while (scan != NULL)
+        {
+            if (node_name(scan) == NULL)
+            {
+                LOG_ERROR("Corrupt internal state: node not in parent's child list.");
+                return false;
+            }
+            if (node_sibling(scan) != node)
+            {
+                scan = node_sibling(scan);
+                continue;
+            }
+
+            scan->sibling = node->sibling;
+            break;
+        }
+
+        parent->child_count--;
+        for (dtb_node* later = node_sibling(node); later != NULL; later = node_sibling(later))
+            later->sibling_index--;
+    }
+
+    node->parent = ref_node(NULL);
+    destroy_dead_node(node);
+    return true;
+}
+
+bool dtb_destroy_prop(dtb_prop* prop)
+{
+    if (prop == NULL)
+        return false;
+
+    dtb_node* node = prop_node(prop);
+    dtb_prop* scan = node_props(node);
+    if (scan == prop)
+    {
+        scan = NULL;
+        node->props = prop->next;
+    }
+
+    while (scan != NULL)
+    {
+        if (prop_next(scan) == NULL)
+            return false;
+        if (prop_next(scan) != prop)
+        {
+            scan = prop_next(scan);
+            continue;
+        }
+
+        scan->next = prop->next;
+        break;
+    }
+    node->prop_count--;
+
+    forget_special_prop(node, prop);
+    free_prop_data(prop);
+    free_write_prop(prop);
+
+    return true;
+}
+
+static bool ensure_prop_has_buffer_for(dtb_prop* prop, size_t buf_size)
+{
+    if (prop == NULL)
+        return false;
+
+    /* the length isn't stored separately from the buffer size, so only reuse an exact fit */
+    if (prop_owns_data(prop) && buf_size == prop_length(prop))
+        return true;
+
+#ifdef SMOLDTB_COMPACT_NODES
+    /* keep a copy of the property header in front of the data, it's where the length is stored */
+    struct fdt_property* header = write_alloc(sizeof(struct fdt_property) + buf_size);
+    if (header == NULL)
+        return false;
+    header->length = be32(buf_size);
+    header->name_offset = 0;
+    void* new_data = header + 1;
+#else
+    void* new_data = try_malloc(buf_size);
+    if (new_data == NULL)
+        return false;
+#endif
+    free_prop_data(prop);
+
+    prop->data = ref_data(new_data);
+#ifndef SMOLDTB_COMPACT_NODES
+    prop->length = buf_size;
+    prop->dataFromMalloc = true;
+#endif
+    return true;
+}
+
+bool dtb_write_prop_string(dtb_prop* prop, const char* str, size_t str_len)
+{
+    if (prop == NULL)
+        return false;
+
+    forget_special_prop(prop_node(prop), prop);
+    if (!ensure_prop_has_buffer_for(prop, str_len))
+        return false;
+
+    memcpy(prop_data(prop), str, str_len);
+    return check_for_special_prop(prop_node(prop), prop);
+}
+
+static bool copy_prop_buffer(dtb_prop* prop, size_t buf_cells, const uint32_t* buf)
+{
+    if (prop == NULL)
+        return false;
+    if (buf == NULL && buf_cells != 0)
+        return false;
+
+    forget_special_prop(prop_node(prop), prop);
+    if (!ensure_prop_has_buffer_for(prop, buf_cells * FDT_CELL_SIZE))
+        return false;
+
+    uint32_t* dest_cells = prop_data(prop);
+    for (size_t i = 0; i < buf_cells; i++)
+        dest_cells[i] = be32(buf[i]);
+
+    return check_for_special_prop(prop_node(prop), prop);
+}
+
+bool dtb_write_prop_1(dtb_prop* prop, size_t count, size_t cell_count, const smoldtb_value* vals)
+{
+    const size_t buf_cells = count * cell_count;
+    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+}
+
+bool dtb_write_prop_2(dtb_prop* prop, size_t count, dtb_pair layout, const dtb_pair* vals)
+{
+    const size_t buf_cells = count * (layout.a + layout.b);
+    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+}
+
+bool dtb_write_prop_3(dtb_prop* prop, size_t count, dtb_triplet layout, const dtb_triplet* vals)
+{
+    const size_t buf_cells = count * (layout.a + layout.b + layout.c);
+    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+}
+
+bool dtb_write_prop_4(dtb_prop* prop, size_t count, dtb_quad layout, const dtb_quad* vals)
+{
+    const size_t buf_cells = count * (layout.a + layout.b + layout.c + layout.d);
+    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+}
+#endif /* SMOLDTB_ENABLE_WRITE_API */
+
+/* ---- Section: Walker Public API ---- */
+
+/* The cells declared by each node on the path to the one being visited. Level 0 holds the
+ * defaults for the root node, which has no parent to declare them.
+ */
+struct dtb_walk_level
+{
+    uint32_t addr_cells;
+    uint32_t size_cells;
+};
+
+static void walk_level_reset(struct dtb_walk_level* level)
+{
+    level->addr_cells = 2;
+    level->size_cells = 1;
+}
+
+static void walk_level_update(struct dtb_walk_level* level, const struct dtb_token* token)
+{
+    if (token->name[0] != '#' || token->length < FDT_CELL_SIZE)
+        return;
+
+    const uint32_t value = be32(*(const uint32_t*)token->data);
+    if (token->name[1] == 'a' && strings_eq(token->name, "#address-cells", sizeof("#address-cells")))
+        level->addr_cells = value;
+    else if (token->name[1] == 's' && strings_eq(token->name, "#size-cells", sizeof("#size-cells")))
+        level->size_cells = value;
+}
+
+static const dtb_walk_context* walk_context(dtb_walk_context* context, const struct dtb_walk_level* levels, size_t depth)
+{
+    context->depth = depth;
+    context->addr_cells = levels[depth].addr_cells;
+    context->size_cells = levels[depth].size_cells;
+    return context;
+}
+
+bool dtb_walk(uintptr_t start, const dtb_walk_callbacks* callbacks, void* opaque)
+{
+    if (start == 0 || callbacks == NULL)
+        return false;
+
+    const struct fdt_header* header = (const struct fdt_header*)start;
+    if (be32(header->magic) != FDT_MAGIC)
+        return false;
+
+    struct dtb_init_info info;
+    info.cells = (const uint32_t*)(start + be32(header->offset_structs));
+    info.cell_count = be32(header->size_structs) / sizeof(uint32_t);
+    info.strings = (const char*)(start + be32(header->offset_strings));
+
+    /* 'open' is the number of nodes that have begun but not ended, so the node that owns a
+     * property is at depth open - 1 and declares the cells in levels[open].
+     */
+    struct dtb_walk_level levels[SMOLDTB_WALK_MAX_DEPTH + 1];
+    walk_level_reset(&levels[0]);
+    dtb_walk_context context;
+    size_t open = 0;
+    size_t offset = 0;
+    while (offset < info.cell_count)
+    {
+        struct dtb_token token;
+        read_token(&info, offset, &token);
+        offset = token.next;
+
+        int action = SMOLDTB_WALK_CONTINUE;
+        if (token.type == FDT_END)
+            break;
+        else if (token.type == FDT_BEGIN_NODE)
+        {
+            if (open == SMOLDTB_WALK_MAX_DEPTH)
+                return false;
+            walk_context(&context, levels, open);
+            walk_level_reset(&levels[++open]);
+            if (callbacks->begin_node != NULL)
+                action = callbacks->begin_node(token.name, &context, opaque);
+            if (action == SMOLDTB_WALK_SKIP)
+            {
+                /* the struct block always ends with FDT_END, running out means it was truncated */
+                offset = skip_node_body(&info, offset);
+                if (offset >= info.cell_count)
+                    return false;
+                open--;
+                action = SMOLDTB_WALK_CONTINUE;
+                if (callbacks->end_node != NULL)
+                    action = callbacks->end_node(&context, opaque);
+            }
+        }
+        else if (token.type == FDT_PROP && open > 0)
+        {
+            /* the callback is handed the data directly, so it has to be inside the struct block */
+            const size_t data_offset = (const uint32_t*)token.data - info.cells;
+            if (token.length > (info.cell_count - data_offset) * FDT_CELL_SIZE)
+                return false;
+            walk_level_update(&levels[open], &token);
+            if (callbacks->prop != NULL)
+                action = callbacks->prop(token.name, token.data, token.length, walk_context(&context, levels, open - 1), opaque);
+        }
+        else if (token.type == FDT_END_NODE && open > 0)
+        {
+            open--;
+            if (callbacks->end_node != NULL)
+                action = callbacks->end_node(walk_context(&context, levels, open), opaque);
+        }
+
+        if (action == SMOLDTB_WALK_STOP)
+            return true;
+    }
+
+    return open == 0;
+}
+
+/* ---- Section: Streaming Public API ---- */
+
+#ifdef SMOLDTB_ENABLE_STREAMING
+static void stream_fail(const char* why)
+{
+    LOG_ERROR(why);
+    free_buffers();
+    state.root = NULL;
+    state.strings = NULL;
+    state.strings_size = 0;
+    state.resv_memory = NULL;
+    state.resv_count = 0;
+}
+
+/* Makes the next 'length' bytes of the blob available at *out, and consumes them. They're used
+ * in place if they're all in the current chunk, otherwise they're copied to the scratch buffer
+ * (or the copies arena if 'keep' is set). Returns false if some are in a later chunk, then the
+ * same call should be made again once it arrives.
+ */
+static bool stream_span(size_t length, bool keep, const void** out)
+{
+    struct dtb_stream* stream = &state.stream;
+    const uint8_t* here = stream->chunk + (stream->pos - stream->chunk_offset);
+    const size_t available = stream->chunk_end - stream->pos;
+    if (stream->span == NULL)
+    {
+        if (available >= length)
+        {
+            *out = here;
+            stream->pos += length;
+            return true;
+        }
+
+        if (keep)
+            stream->span = arena_alloc_run(&stream->copies, dtb_align_up(length, sizeof(uint64_t)) / sizeof(uint64_t), 0);
+        else if (length <= sizeof(stream->scratch))
+            stream->span = (uint8_t*)stream->scratch;
+        if (stream->span == NULL)
+        {
+            stream_fail("Not enough space to copy data split between chunks.");
+            return false;
+        }
+        stream->span_have = 0;
+    }
+
+    const size_t count = length - stream->span_have < available ? length - stream->span_have : available;
+    memcpy(stream->span + stream->span_have, here, count);
+    stream->span_have += count;
+    stream->pos += count;
+    if (stream->span_have < length)
+        return false;
+
+    *out = stream->span;
+    stream->span = NULL;
+    return true;
+}
+
+/* Like stream_span(), for the null-terminated name of a node. Names that are split between
+ * chunks are gathered in the scratch buffer, then copied to the copies arena.
+ */
+static bool stream_node_name(const char** out)
+{
+    struct dtb_stream* stream = &state.stream;
+    const char* here = (const char*)stream->chunk + (stream->pos - stream->chunk_offset);
+    const size_t limit = (stream->chunk_end < stream->struct_end ? stream->chunk_end : stream->struct_end) - stream->pos;
+    size_t length = 0;
+    while (length < limit && here[length] != 0)
+        length++;
+
+    if (stream->span == NULL && length < limit)
+    {
+        *out = here;
+        stream->pos += length + 1;
+        return true;
+    }
+    if (stream->span == NULL)
+    {
+        stream->span = (uint8_t*)stream->scratch;
+        stream->span_have = 0;
+    }
+
+    const size_t count = length < limit ? length + 1 : length;
+    if (stream->span_have + count > sizeof(stream->scratch))
+    {
+        stream_fail("Node name split between chunks is too long.");
+        return false;
+    }
+    memcpy(stream->span + stream->span_have, here, count);
+    stream->span_have += count;
+    stream->pos += count;
+    if (length == limit)
+    {
+        if (stream->pos == stream->struct_end)
+            stream_fail("Node name runs past the end of the struct block.");
+        return false;
+    }
+
+    char* name = arena_alloc_run(&stream->copies, dtb_align_up(stream->span_have, sizeof(uint64_t)) / sizeof(uint64_t), 0);
+    if (name == NULL)
+    {
+        stream_fail("Not enough space to copy data split between chunks.");
+        return false;
+    }
+    memcpy(name, stream->span, stream->span_have);
+    stream->span = NULL;
+    *out = name;
+    return true;
+}
+
+static void stream_header()
+{
+    struct dtb_stream* stream = &state.stream;
+    const void* data;
+    if (!stream_span(sizeof(struct fdt_header), false, &data))
+        return;
+    const struct fdt_header* header = data;
+    if (be32(header->magic) != FDT_MAGIC)
+    {
+        stream_fail("FDT has incorrect magic number.");
+        return;
+    }
+
+    stream->total_size = be32(header->total_size);
+    stream->resv_offset = be32(header->offset_memmap_rsvd);
+    stream->struct_offset = be32(header->offset_structs);
+    stream->struct_end = stream->struct_offset + be32(header->size_structs);
+    stream->strings_offset = be32(header->offset_strings);
+    stream->strings_end = stream->strings_offset + be32(header->size_strings);
+    stream->info.cell_count = be32(header->size_structs) / FDT_CELL_SIZE;
+
+    /* blocks are read in the order they appear, so none of them can overlap the header */
+    const size_t header_size = sizeof(struct fdt_header);
+    if (stream->resv_offset < header_size || stream->struct_offset < header_size || stream->strings_offset < header_size
+        || stream->resv_offset + sizeof(struct fdt_reserved_mem_entry) > stream->total_size
+        || stream->struct_end > stream->total_size || stream->strings_end > stream->total_size
+        || stream->resv_offset % sizeof(uint64_t) != 0 || stream->struct_offset % FDT_CELL_SIZE != 0)
+    {
+        stream_fail("FDT header is invalid.");
+        return;
+    }
+
+    if (stream->chunk_end > stream->total_size)
+        stream->chunk_end = stream->total_size;
+    stream->step = STREAM_STEP_SEEK;
+}
+
+/* Moves through the blob until the next block starts, keeping track of the pieces of the
+ * strings block as they go past.
+ */
+static void stream_seek()
+{
+    struct dtb_stream* stream = &state.stream;
+    if (!stream->resv_done && stream->pos == stream->resv_offset)
+    {
+        stream->step = STREAM_STEP_RESV;
+        return;
+    }
+    if (!stream->struct_done && stream->pos == stream->struct_offset)
+    {
+        stream->step = STREAM_STEP_TOKEN;
+        return;
+    }
+
+    size_t end = stream->chunk_end;
+    if (stream->pos >= stream->strings_offset && stream->pos < stream->strings_end)
+    {
+        if (end > stream->strings_end)
+            end = stream->strings_end;
+        struct dtb_stream_fragment* fragment = arena_alloc(&stream->fragments, 0);
+        if (fragment == NULL)
+        {
+            stream_fail("Not enough space for strings block pieces.");
+            return;
+        }
+        fragment->offset = stream->pos - stream->strings_offset;
+        fragment->data = (const char*)stream->chunk + (stream->pos - stream->chunk_offset);
+        fragment->length = end - stream->pos;
+        fragment->tail_copy = NULL;
+        stream->pos = end;
+        return;
+    }
+
+    if (!stream->resv_done && stream->resv_offset > stream->pos && stream->resv_offset < end)
+        end = stream->resv_offset;
+    if (!stream->struct_done && stream->struct_offset > stream->pos && stream->struct_offset < end)
+        end = stream->struct_offset;
+    if (stream->strings_offset > stream->pos && stream->strings_offset < end)
+        end = stream->strings_offset;
+    stream->pos = end;
+}
+
+/* The reserved memory block is read as one span, running until the next block starts. */
+static void stream_resv()
+{
+    struct dtb_stream* stream = &state.stream;
+    size_t end = stream->total_size;
+    if (stream->struct_offset > stream->resv_offset && stream->struct_offset < end)
+        end = stream->struct_offset;
+    if (stream->strings_offset > stream->resv_offset && stream->strings_offset < end)
+        end = stream->strings_offset;
+
+    const void* resv;
+    if (!stream_span(end - stream->resv_offset, true, &resv))
+        return;
+
+    /* the reserved memory block ends with an entry where both the address and size are 0 */
+    state.resv_memory = (uint64_t*)resv;
+    state.resv_count = 0;
+    const size_t resv_max = (end - stream->resv_offset) / sizeof(struct fdt_reserved_mem_entry);
+    while (state.resv_count < resv_max
+        && (state.resv_memory[state.resv_count * 2] != 0 || state.resv_memory[state.resv_count * 2 + 1] != 0))
+        state.resv_count++;
+    stream->resv_done = true;
+    stream->step = STREAM_STEP_SEEK;
+}
 
-    sibling->fromMalloc = true;
-    sibling->sibling = node->sibling;
-    node->sibling = sibling;
-    return sibling;
+static size_t stream_cell_offset()
+{
+    return (state.stream.pos - state.stream.struct_offset) / FDT_CELL_SIZE;
 }
 
-dtb_node* dtb_create_child(dtb_node* node, const char* name)
+/* Creates a node, the same as parse_node_begin() and parse_roots() would. */
+static void stream_begin_node(const char* name)
 {
-    if (node == NULL || name == NULL)
-        return NULL;
+    struct dtb_stream* stream = &state.stream;
+    dtb_node* node = alloc_node(&stream->info, stream_cell_offset());
+    if (node == NULL)
+    {
+        stream_fail("Failed to parse FDT struct block.");
+        return;
+    }
+    node->name = ref_str(name[0] == 0 ? NULL : name);
+    node->fromMalloc = false;
 
-    struct name_collision_check check_data;
-    check_data.collision = false;
-    check_data.name = name;
-    check_data.name_len = string_len(name);
-    if (string_find_char(name, '/') < check_data.name_len)
-        check_data.name_len = string_find_char(name, '/');
+    if (stream->node != NULL)
+        add_child(stream->node, &stream->last_child, node);
+    else if (stream->last_root != NULL)
+    {
+        stream->last_root->sibling = ref_node(node);
+        node->sibling_index = stream->last_root->sibling_index + 1;
+    }
+    else
+        state.root = node;
+    if (stream->node == NULL)
+        stream->last_root = node;
+
+    stream->node = node;
+    stream->last_child = NULL;
+    stream->last_prop = NULL;
+    stream->skip = dtb_align_up(stream->pos, FDT_CELL_SIZE) - stream->pos;
+    stream->step = STREAM_STEP_TOKEN;
+}
 
-    do_foreach_sibling(node->child, check_sibling_name_collisions, &check_data);
-    if (check_data.collision)
+static void stream_begin_prop(const struct fdt_property* header)
+{
+    struct dtb_stream* stream = &state.stream;
+    const size_t length = be32(header->length);
+    if (length > stream->struct_end - stream->pos)
     {
-        LOG_ERROR("Failed to create node with duplicate name.");
-        return NULL;
+        stream_fail("Property runs past the end of the struct block.");
+        return;
+    }
+    if (stream->node == NULL)
+    {
+        /* not part of any node, parse_roots() ignores these too */
+        stream->skip = dtb_align_up(length, FDT_CELL_SIZE);
+        stream->step = STREAM_STEP_TOKEN;
+        return;
     }
 
-    const size_t name_len = string_len(name);
-    char* name_buf = try_malloc(name_len + 1);
-    if (name_buf == NULL)
-        return NULL;
-    memcpy(name_buf, name, name_len);
+    dtb_prop* prop = alloc_prop(&stream->info, stream_cell_offset());
+    uint32_t* name_offset = arena_alloc(&stream->name_offsets, 0);
+    if (prop == NULL || name_offset == NULL)
+    {
+        stream_fail("Failed to parse FDT struct block.");
+        return;
+    }
+    *name_offset = be32(header->name_offset);
+    prop->length = length;
+    prop->fromMalloc = false;
+    prop->dataFromMalloc = false;
 
-    dtb_node* child = try_malloc(sizeof(dtb_node));
-    if (child == NULL)
+    /* after a child node ends, the end of the parent's properties has to be found again */
+    if (stream->last_prop == NULL)
     {
-        LOG_ERROR("Failed to allocate node for child.");
-        return NULL;
+        for (dtb_prop* last = node_props(stream->node); last != NULL; last = prop_next(last))
+            stream->last_prop = last;
     }
+    add_prop(stream->node, &stream->last_prop, prop);
+    stream->prop = prop;
+    stream->step = STREAM_STEP_PROP_DATA;
+}
 
-    child->parent = node;
-    child->name = name_buf;
-    child->fromMalloc = true;
-    child->sibling = node->child;
-    node->child = child;
-    return child;
+static void stream_end_node()
+{
+    struct dtb_stream* stream = &state.stream;
+    stream->last_child = stream->node;
+    stream->last_prop = NULL;
+    stream->node = node_parent(stream->node);
 }
 
-dtb_prop* dtb_create_prop(dtb_node* node, const char* name)
+static void stream_struct_step()
 {
-    if (node == NULL || name == NULL)
-        return NULL;
+    struct dtb_stream* stream = &state.stream;
+    const void* data;
+    const char* name;
+    switch (stream->step)
+    {
+    case STREAM_STEP_TOKEN:
+        if (!stream_span(FDT_CELL_SIZE, false, &data))
+            return;
+        switch (be32(*(const uint32_t*)data))
+        {
+        case FDT_BEGIN_NODE:
+            stream->step = STREAM_STEP_NODE_NAME;
+            break;
+        case FDT_PROP:
+            stream->step = STREAM_STEP_PROP_HEADER;
+            break;
+        case FDT_END_NODE:
+            if (stream->node != NULL)
+                stream_end_node();
+            break;
+        case FDT_END:
+            stream->struct_done = true;
+            stream->step = STREAM_STEP_SEEK;
+            break;
+        }
+        break;
 
-    const size_t name_len = string_len(name);
-    struct name_collision_check check_data;
-    check_data.collision = false;
-    check_data.name = name;
-    check_data.name_len = name_len;
+    case STREAM_STEP_NODE_NAME:
+        if (stream_node_name(&name))
+            stream_begin_node(name);
+        break;
 
-    do_foreach_prop(node, check_prop_name_collisions, &check_data);
-    if (check_data.collision)
-    {
-        LOG_ERROR("Failed to create prop with duplicate name.");
-        return NULL;
+    case STREAM_STEP_PROP_HEADER:
+        if (stream_span(sizeof(struct fdt_property), false, &data))
+            stream_begin_prop(data);
+        break;
+
+    case STREAM_STEP_PROP_DATA:
+        if (!stream_span(prop_length(stream->prop), true, &data))
+            return;
+        stream->prop->data = ref_data((void*)data);
+        stream->skip = dtb_align_up(stream->pos, FDT_CELL_SIZE) - stream->pos;
+        stream->step = STREAM_STEP_TOKEN;
+        break;
     }
+}
 
-    char* name_buf = try_malloc(name_len + 1);
-    if (name_buf == NULL)
-        return NULL;
-    memcpy(name_buf, name, name_len);
+/* Consumes as much of the current chunk as possible. */
+static void stream_consume()
+{
+    struct dtb_stream* stream = &state.stream;
+    while (stream->pos < stream->chunk_end && stream->step != STREAM_STEP_IDLE)
+    {
+        if (stream->skip != 0)
+        {
+            const size_t count = stream->skip < stream->chunk_end - stream->pos ? stream->skip : stream->chunk_end - stream->pos;
+            stream->pos += count;
+            stream->skip -= count;
+            continue;
+        }
+        if (stream->step == STREAM_STEP_TOKEN && stream->pos >= stream->struct_end)
+        {
+            stream->struct_done = true;
+            stream->step = STREAM_STEP_SEEK;
+        }
 
-    dtb_prop* prop = try_malloc(sizeof(dtb_prop));
-    if (prop == NULL)
+        if (stream->step == STREAM_STEP_HEADER)
+            stream_header();
+        else if (stream->step == STREAM_STEP_SEEK)
+            stream_seek();
+        else if (stream->step == STREAM_STEP_RESV)
+            stream_resv();
+        else
+            stream_struct_step();
+    }
+}
+
+/* Copies the string starting at 'start' in a piece of the strings block (and continuing into the
+ * following pieces) to 'dest', or just measures it if 'dest' is NULL. Returns the length of the
+ * string, or -1 if the strings block ends first.
+ */
+static size_t stream_gather_string(struct dtb_arena_page* page, size_t index, size_t start, char* dest)
+{
+    struct dtb_arena* fragments = &state.stream.fragments;
+    size_t length = 0;
+    while (page != NULL)
     {
-        LOG_ERROR("Failed to allocate property");
-        return NULL;
+        const struct dtb_stream_fragment* fragment = arena_page_elem(fragments, page, index);
+        for (size_t i = start; i < fragment->length; i++)
+        {
+            if (dest != NULL)
+                dest[length] = fragment->data[i];
+            if (fragment->data[i] == 0)
+                return length;
+            length++;
+        }
+
+        start = 0;
+        if (++index == page->used)
+        {
+            page = page->next;
+            index = 0;
+        }
     }
 
-    prop->length = 0;
-    prop->data = NULL;
-    prop->name = name_buf;
-    prop->fromMalloc = true;
-    prop->dataFromMalloc = false;
-    prop->next = node->props;
-    prop->node = node;
-    node->props = prop;
-    return prop;
+    return -1ul;
 }
 
-bool dtb_destroy_node(dtb_node* node)
+/* Finds the string at 'offset' in the strings block. Strings that are split between pieces are
+ * copied, once for each place they're split.
+ */
+static const char* stream_string(size_t offset)
 {
-    if (node == NULL)
-        return false;
-
-    if (node->parent != NULL) /* break linkage in parents list of child nodes */
+    struct dtb_arena* fragments = &state.stream.fragments;
+    for (struct dtb_arena_page* page = fragments->head; page != NULL; page = page->next)
     {
-        dtb_node* scan = node->parent->child;
-        if (scan == node)
+        for (size_t i = 0; i < page->used; i++)
         {
-            scan = NULL;
-            node->parent->child = node->sibling;
+            struct dtb_stream_fragment* fragment = arena_page_elem(fragments, page, i);
+            if (offset < fragment->offset || offset - fragment->offset >= fragment->length)
+                continue;
+
+            const size_t start = offset - fragment->offset;
+            const char* str = fragment->data + start;
+            if (string_len_bounded(str, fragment->length - start) < fragment->length - start)
+                return str;
+
+            if (fragment->tail_copy != NULL && offset >= fragment->tail_offset
+                && offset - fragment->tail_offset <= string_len(fragment->tail_copy))
+                return fragment->tail_copy + (offset - fragment->tail_offset);
+
+            const size_t length = stream_gather_string(page, i, start, NULL);
+            if (length == -1ul)
+                return NULL;
+            char* copy = arena_alloc_run(&state.stream.copies, dtb_align_up(length + 1, sizeof(uint64_t)) / sizeof(uint64_t), 0);
+            if (copy == NULL)
+                return NULL;
+            stream_gather_string(page, i, start, copy);
+            fragment->tail_offset = offset;
+            fragment->tail_copy = copy;
+            return copy;
         }
+    }
 
-        while (scan != NULL)
+    return NULL;
+}
+
+/* Properties and their name offsets were allocated in the same order. */
+static bool stream_resolve_names()
+{
+    struct dtb_arena* name_offsets = &state.stream.name_offsets;
+    struct dtb_arena_page* offsets_page = name_offsets->head;
+    size_t offsets_index = 0;
+    for (struct dtb_arena_page* page = state.prop_arena.head; page != NULL; page = page->next)
+    {
+        for (size_t i = 0; i < page->used; i++)
         {
-            if (scan->name == NULL)
-            {
-                LOG_ERROR("Corrupt internal state: node not in parent's child list.");
-                return false;
-            }
-            if (scan->sibling != node)
+            if (offsets_index == offsets_page->used)
             {
-                scan = scan->sibling;
-                continue;
+                offsets_page = offsets_page->next;
+                offsets_index = 0;
             }
+            const uint32_t* name_offset = arena_page_elem(name_offsets, offsets_page, offsets_index++);
+            const char* name = stream_string(*name_offset);
+            if (name == NULL)
+                return false;
 
-            scan->sibling = node->sibling;
-            break;
+            dtb_prop* prop = arena_page_elem(&state.prop_arena, page, i);
+            prop->name = ref_str(name);
         }
     }
 
-    node->parent = NULL;
-    destroy_dead_node(node);
     return true;
 }
 
-bool dtb_destroy_prop(dtb_prop* prop)
+static void stream_finish()
 {
-    if (prop == NULL)
-        return false;
-
-    dtb_prop* scan = prop->node->props;
-    if (scan == prop)
+    struct dtb_stream* stream = &state.stream;
+    if (stream->step == STREAM_STEP_TOKEN && stream->pos >= stream->struct_end)
     {
-        scan = NULL;
-        prop->node->props = prop->next;
+        stream->struct_done = true;
+        stream->step = STREAM_STEP_SEEK;
+    }
+    if (stream->step != STREAM_STEP_SEEK || !stream->resv_done || !stream->struct_done || stream->node != NULL)
+    {
+        stream_fail("FDT ended before the struct block was complete.");
+        return;
+    }
+    if (!stream_resolve_names())
+    {
+        stream_fail("Property name is missing from the strings block.");
+        return;
     }
 
-    while (scan != NULL)
+    /* dtb_intern() needs the strings block in one piece */
+    const struct dtb_stream_fragment* strings = NULL;
+    if (stream->fragments.count == 1)
+        strings = arena_page_elem(&stream->fragments, stream->fragments.head, 0);
+    state.strings = strings != NULL ? strings->data : NULL;
+    state.strings_size = strings != NULL ? strings->length : 0;
+    arena_release(&stream->name_offsets);
+    arena_release(&stream->fragments);
+
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    reserve_indexes_for_tree();
+#endif
+    if (!index_parsed_tree())
     {
-        if (scan->next == NULL)
-            return false;
-        if (scan->next != prop)
-        {
-            scan = scan->next;
-            continue;
-        }
+        stream_fail("Failed to parse FDT struct block.");
+        return;
+    }
+    finish_parse();
+    stream->step = STREAM_STEP_DONE;
+}
 
-        scan->next = prop->next;
-        break;
+bool dtb_init_stream(dtb_ops ops)
+{
+    state.ops = ops;
+
+#if !defined(SMOLDTB_STATIC_BUFFER_SIZE)
+    if (state.ops.malloc == NULL)
+    {
+        LOG_ERROR("smoldtb has been compiled without an internal static buffer, but not passed a malloc() function.");
+        return false;
     }
+#endif
 
-    if (prop->dataFromMalloc)
-        try_free(prop->data, prop->length);
-    if (prop->fromMalloc)
-        try_free(prop, sizeof(dtb_prop));
+    begin_parse();
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    state.compat_valid = true; //filled in once the property names are known
+#endif
+    state.strings = NULL;
+    state.strings_size = 0;
+    state.resv_memory = NULL;
+    state.resv_count = 0;
+
+    struct dtb_stream* stream = &state.stream;
+    const struct dtb_stream empty = { 0 };
+    *stream = empty;
+    arena_init(&stream->copies, sizeof(uint64_t));
+    arena_init(&stream->name_offsets, sizeof(uint32_t));
+    arena_init(&stream->fragments, sizeof(struct dtb_stream_fragment));
+    stream->step = STREAM_STEP_HEADER;
 
     return true;
 }
 
-static bool ensure_prop_has_buffer_for(dtb_prop* prop, size_t buf_size)
+size_t dtb_feed(const void* chunk, size_t length)
 {
-    if (prop == NULL)
-        return false;
+    struct dtb_stream* stream = &state.stream;
+    if (stream->step == STREAM_STEP_IDLE)
+        return SMOLDTB_FEED_FAILURE;
 
-    if (prop->dataFromMalloc && buf_size <= prop->length)
-        return true;
+    if (stream->step != STREAM_STEP_DONE && length != 0)
+    {
+        /* data is used in place, so it has to be aligned like it would be in a contiguous blob */
+        if (chunk == NULL || ((uintptr_t)chunk - stream->pos) % sizeof(uint64_t) != 0)
+        {
+            stream_fail("Chunk isn't aligned to match its offset in the FDT.");
+            return SMOLDTB_FEED_FAILURE;
+        }
 
-    void* new_data = try_malloc(buf_size);
-    if (new_data == NULL)
-        return false;
-    if (prop->dataFromMalloc)
-        try_free(prop->data, prop->length);
+        stream->chunk = chunk;
+        stream->chunk_offset = stream->pos;
+        stream->chunk_end = stream->pos + length;
+        if (stream->step != STREAM_STEP_HEADER && stream->chunk_end > stream->total_size)
+            stream->chunk_end = stream->total_size;
+        stream_consume();
 
-    prop->data = new_data;
-    prop->length = buf_size;
-    return true;
+        if (stream->step != STREAM_STEP_IDLE && stream->step != STREAM_STEP_HEADER && stream->pos == stream->total_size)
+            stream_finish();
+    }
+
+    if (stream->step == STREAM_STEP_IDLE)
+        return SMOLDTB_FEED_FAILURE;
+    if (stream->step == STREAM_STEP_DONE)
+        return 0;
+    if (stream->step == STREAM_STEP_HEADER)
+        return sizeof(struct fdt_header) - stream->pos;
+    return stream->total_size - stream->pos;
 }
+#endif /* SMOLDTB_ENABLE_STREAMING */
 
-bool dtb_write_prop_string(dtb_prop* prop, const char* str, size_t str_len)
+/* ---- Section: Context Public API ---- */
+
+#ifdef SMOLDTB_ENABLE_CONTEXTS
+dtb_ctx* dtb_ctx_create(dtb_ops ops)
 {
-    if (prop == NULL)
-        return false;
+    if (ops.malloc == NULL)
+        return NULL;
 
-    if (!ensure_prop_has_buffer_for(prop, str_len))
-        return false;
+    dtb_ctx* ctx = ops.malloc(sizeof(dtb_ctx));
+    if (ctx == NULL)
+        return NULL;
+    const dtb_ctx empty = { 0 };
+    *ctx = empty;
+    ctx->ops = ops;
 
-    memcpy(prop->data, str, str_len);
-    return true;
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    ctx->buff = ops.malloc(SMOLDTB_STATIC_BUFFER_SIZE);
+    if (ctx->buff == NULL)
+    {
+        if (ops.free != NULL)
+            ops.free(ctx, sizeof(dtb_ctx));
+        return NULL;
+    }
+#endif
+
+    return ctx;
 }
 
-static bool copy_prop_buffer(dtb_prop* prop, size_t buf_cells, const uint32_t* buf)
+void dtb_ctx_destroy(dtb_ctx* ctx)
 {
-    if (prop == NULL)
-        return false;
-    if (buf == NULL && buf_cells != 0)
-        return false;
+    if (ctx == NULL)
+        return;
 
-    if (!ensure_prop_has_buffer_for(prop, buf_cells * FDT_CELL_SIZE))
-        return false;
+    dtb_ctx* prev = use_ctx(ctx);
+    free_buffers();
+    current_state = prev;
 
-    uint32_t* dest_cells = prop->data;
-    for (size_t i = 0; i < buf_cells; i++)
-        dest_cells[i] = be32(buf[i]);
+    const dtb_ops ops = ctx->ops;
+    if (ops.free == NULL)
+        return;
+#ifdef SMOLDTB_STATIC_BUFFER_SIZE
+    ops.free(ctx->buff, SMOLDTB_STATIC_BUFFER_SIZE);
+#endif
+    ops.free(ctx, sizeof(dtb_ctx));
+}
 
-    return true;
+#define DEFINE_CTX(ret, name, params, args) \
+    ret dtb_ctx_##name params \
+    { \
+        dtb_ctx* prev = use_ctx(ctx); \
+        ret result = dtb_##name args; \
+        current_state = prev; \
+        return result; \
+    }
+#define DEFINE_CTX_READ_1(x) \
+    DEFINE_CTX(size_t, read_prop_1_##x, (dtb_ctx* ctx, dtb_prop* prop, smoldtb_value* vals), (prop, vals))
+#define DEFINE_CTX_READ_2(x, y) \
+    DEFINE_CTX(size_t, read_prop_2_##x##_##y, (dtb_ctx* ctx, dtb_prop* prop, dtb_pair* vals), (prop, vals))
+#define DEFINE_CTX_READ_3(x, y, z) \
+    DEFINE_CTX(size_t, read_prop_3_##x##_##y##_##z, (dtb_ctx* ctx, dtb_prop* prop, dtb_triplet* vals), (prop, vals))
+
+SMOLDTB_CTX_FUNCS(DEFINE_CTX)
+SMOLDTB_FIXED_LAYOUTS_1(DEFINE_CTX_READ_1)
+SMOLDTB_FIXED_LAYOUTS_2(DEFINE_CTX_READ_2)
+SMOLDTB_FIXED_LAYOUTS_3(DEFINE_CTX_READ_3)
+#ifdef SMOLDTB_ENABLE_WRITE_API
+SMOLDTB_CTX_WRITE_FUNCS(DEFINE_CTX)
+#endif
+#ifdef SMOLDTB_ENABLE_STREAMING
+SMOLDTB_CTX_STREAM_FUNCS(DEFINE_CTX)
+#endif
+#endif /* SMOLDTB_ENABLE_CONTEXTS */
+
+/* ---- Section: Snapshot Public API ---- */
+
+#ifdef SMOLDTB_ENABLE_SNAPSHOTS
+/* Readers announce themselves in one of two counters, selected by the low bit of the epoch
+ * when they entered. After swapping in a new snapshot, the publisher advances the epoch (so new
+ * readers use the other counter) and waits for the previous counter to drain, then does the
+ * same again for the other counter. Any reader that could have seen the old snapshot was
+ * counted in one of them, and readers that arrive later always see the new snapshot.
+ */
+static dtb_ctx* snapshot_current;
+static size_t snapshot_epoch;
+static size_t snapshot_readers[2];
+
+#ifdef SMOLDTB_LAZY_PARSE
+/* Readers share a snapshot without locking, so nothing can be left to parse on first use. */
+static void finish_lazy_parse()
+{
+    expand_all();
+#ifdef SMOLDTB_COMPATIBLE_INDEX
+    if (!state.compat_built)
+        build_compat_index();
+#endif
+#ifdef SMOLDTB_RANGES_CACHE
+    if (!state.ranges_built)
+        build_ranges_cache();
+#endif
+#ifdef SMOLDTB_INTERRUPT_MAP_CACHE
+    if (!state.irq_map_built)
+        build_irq_map_cache();
+#endif
+#ifdef SMOLDTB_ADDRESS_INDEX
+    if (!state.addr_built)
+        build_addr_index();
+#endif
+}
+#endif
+
+/* Tells the cpu we're spinning, so it can give the pipeline to a sibling thread or save power. */
+static void snapshot_spin_hint()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || (defined(__ARM_ARCH) && __ARM_ARCH >= 7)
+    __asm__ volatile("yield");
+#elif defined(__riscv_zihintpause)
+    __asm__ volatile("pause");
+#endif
 }
 
-bool dtb_write_prop_1(dtb_prop* prop, size_t count, size_t cell_count, const smoldtb_value* vals)
+static void wait_for_snapshot_readers()
 {
-    const size_t buf_cells = count * cell_count;
-    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+    for (size_t phase = 0; phase < 2; phase++)
+    {
+        const size_t epoch = __atomic_fetch_add(&snapshot_epoch, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&snapshot_readers[epoch & 1], __ATOMIC_SEQ_CST) != 0)
+            snapshot_spin_hint();
+    }
 }
 
-bool dtb_write_prop_2(dtb_prop* prop, size_t count, dtb_pair layout, const dtb_pair* vals)
+bool dtb_snapshot_publish(uintptr_t start, dtb_ops ops)
 {
-    const size_t buf_cells = count * (layout.a + layout.b);
-    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+    dtb_ctx* ctx = dtb_ctx_create(ops);
+    if (ctx == NULL)
+    {
+        if (ops.on_error != NULL)
+            ops.on_error("Not enough space for snapshot context.");
+        return false;
+    }
+
+    dtb_ctx* prev = use_ctx(ctx);
+    const bool success = dtb_init(start, ops);
+#ifdef SMOLDTB_LAZY_PARSE
+    if (success)
+        finish_lazy_parse();
+#endif
+    current_state = prev;
+    if (!success)
+    {
+        dtb_ctx_destroy(ctx);
+        return false;
+    }
+
+    dtb_ctx* old = __atomic_exchange_n(&snapshot_current, ctx, __ATOMIC_SEQ_CST);
+    if (old != NULL)
+    {
+        wait_for_snapshot_readers();
+        dtb_ctx_destroy(old);
+    }
+    return true;
 }
 
-bool dtb_write_prop_3(dtb_prop* prop, size_t count, dtb_triplet layout, const dtb_triplet* vals)
+dtb_snapshot dtb_snapshot_enter(void)
 {
-    const size_t buf_cells = count * (layout.a + layout.b + layout.c);
-    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+    dtb_snapshot snapshot;
+    snapshot.epoch = __atomic_load_n(&snapshot_epoch, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&snapshot_readers[snapshot.epoch & 1], 1, __ATOMIC_SEQ_CST);
+    snapshot.ctx = __atomic_load_n(&snapshot_current, __ATOMIC_SEQ_CST);
+    return snapshot;
 }
 
-bool dtb_write_prop_4(dtb_prop* prop, size_t count, dtb_quad layout, const dtb_quad* vals)
+void dtb_snapshot_exit(dtb_snapshot snapshot)
 {
-    const size_t buf_cells = count * (layout.a + layout.b + layout.c + layout.d);
-    return copy_prop_buffer(prop, buf_cells, (const uint32_t*)vals);
+    __atomic_fetch_sub(&snapshot_readers[snapshot.epoch & 1], 1, __ATOMIC_SEQ_CST);
 }
-#endif /* SMOLDTB_ENABLE_WRITE_API */
+#endif /* SMOLDTB_ENABLE_SNAPSHOTS */
+
@@ -9,13 +9,29 @@ extern "C" {
 #endif
 
 #define SMOLDTB_INIT_EMPTY_TREE 0
+#define SMOLDTB_STRING_NOT_FOUND ((size_t)-1)
+#define SMOLDTB_MEMORY_USABLE 0
+#define SMOLDTB_MEMORY_RESERVED 1
+#define SMOLDTB_MEMORY_NO_MAP 2
+#define SMOLDTB_WALK_CONTINUE 0
+#define SMOLDTB_WALK_STOP 1
+#define SMOLDTB_WALK_SKIP 2
 
 #ifndef smoldtb_value
 #define smoldtb_value uintmax_t
 #endif
 
+#ifndef SMOLDTB_MAX_INTERRUPT_CELLS
+#define SMOLDTB_MAX_INTERRUPT_CELLS 4
+#endif
+
+#ifndef SMOLDTB_WALK_MAX_DEPTH
+#define SMOLDTB_WALK_MAX_DEPTH 16
+#endif
+
 typedef struct dtb_node_t dtb_node;
 typedef struct dtb_prop_t dtb_prop;
+typedef struct dtb_ctx_t dtb_ctx;
 
 typedef struct
 {
@@ -51,6 +67,7 @@ typedef struct
     size_t child_count;
     size_t prop_count;
     size_t sibling_count;
+    size_t sibling_index;
 } dtb_node_stat;
 
 typedef struct
@@ -66,36 +83,239 @@ typedef struct
     uint64_t length;
 } dtb_reserved_memory;
 
+typedef struct
+{
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+} dtb_memory_range;
+
+typedef struct
+{
+    dtb_node* node;
+    size_t index;
+} dtb_match;
+
+typedef struct
+{
+    const char* name;
+    bool exact;
+} dtb_atom;
+
+typedef struct
+{
+    dtb_prop* next;
+} dtb_prop_iter;
+
+typedef struct
+{
+    dtb_node* next;
+} dtb_child_iter;
+
+typedef struct
+{
+    dtb_prop* prop;
+    size_t pos;
+} dtb_string_iter;
+
+typedef struct
+{
+    const uint32_t* cells;
+    size_t remaining;
+} dtb_cell_reader;
+
+typedef struct
+{
+    dtb_node* controller;
+    size_t cell_count;
+    uint32_t cells[SMOLDTB_MAX_INTERRUPT_CELLS];
+} dtb_interrupt;
+
+typedef struct
+{
+    size_t depth;
+    size_t addr_cells;
+    size_t size_cells;
+} dtb_walk_context;
+
+typedef struct
+{
+    int (*begin_node)(const char* name, const dtb_walk_context* context, void* opaque);
+    int (*prop)(const char* name, const void* data, size_t length, const dtb_walk_context* context, void* opaque);
+    int (*end_node)(const dtb_walk_context* context, void* opaque);
+} dtb_walk_callbacks;
+
 size_t dtb_query_total_size(uintptr_t fdt_start);
+bool dtb_walk(uintptr_t start, const dtb_walk_callbacks* callbacks, void* opaque);
 
 bool dtb_init(uintptr_t start, dtb_ops ops);
 
 dtb_node* dtb_find_compatible(dtb_node* node, const char* str);
+dtb_node* dtb_find_compatible_in(dtb_node* subtree, dtb_node* start, const char* str);
 dtb_node* dtb_find_phandle(unsigned handle);
+size_t dtb_match_compatible(const char* const* table, size_t table_count, dtb_match* matches, size_t match_count);
 dtb_node* dtb_find(const char* path);
 dtb_node* dtb_find_child(dtb_node* node, const char* name);
 dtb_prop* dtb_find_prop(dtb_node* node, const char* name);
+dtb_atom dtb_intern(const char* name);
+dtb_prop* dtb_find_prop_atom(dtb_node* node, dtb_atom atom);
 
 dtb_node* dtb_get_sibling(dtb_node* node);
 dtb_node* dtb_get_child(dtb_node* node);
 dtb_node* dtb_get_parent(dtb_node* node);
+size_t dtb_get_path(dtb_node* node, char* buff, size_t buff_len);
 dtb_prop* dtb_get_prop(dtb_node* node, size_t index);
+dtb_prop_iter dtb_get_prop_iter(dtb_node* node);
+dtb_prop* dtb_prop_next(dtb_prop_iter* iter);
+dtb_child_iter dtb_get_child_iter(dtb_node* node);
+dtb_node* dtb_child_next(dtb_child_iter* iter);
 size_t dtb_get_addr_cells_of(dtb_node* node);
 size_t dtb_get_size_cells_of(dtb_node* node);
 size_t dtb_get_addr_cells_for(dtb_node* node);
 size_t dtb_get_size_cells_for(dtb_node* node);
 
 bool dtb_is_compatible(dtb_node* node, const char* str);
+bool dtb_is_enabled(dtb_node* node);
 bool dtb_stat_node(dtb_node* node, dtb_node_stat* stat);
 bool dtb_stat_prop(dtb_prop* prop, dtb_prop_stat* stat);
 
 size_t dtb_read_resv_memory(size_t entry_count, dtb_reserved_memory* vals);
+size_t dtb_build_memory_map(dtb_memory_range* ranges, size_t max);
 const char* dtb_read_prop_string(dtb_prop* prop, size_t index);
+dtb_string_iter dtb_get_string_iter(dtb_prop* prop);
+const char* dtb_string_next(dtb_string_iter* iter, size_t* len);
+size_t dtb_find_string_index(dtb_prop* prop, const char* str);
 size_t dtb_read_prop_1(dtb_prop* prop, size_t cell_count, smoldtb_value* vals);
 size_t dtb_read_prop_2(dtb_prop* prop, dtb_pair layout, dtb_pair* vals);
 size_t dtb_read_prop_3(dtb_prop* prop, dtb_triplet layout, dtb_triplet* vals);
 size_t dtb_read_prop_4(dtb_prop* prop, dtb_quad layout, dtb_quad* vals);
 
+dtb_cell_reader dtb_get_cell_reader(dtb_prop* prop);
+bool dtb_reader_next_value(dtb_cell_reader* reader, size_t cell_count, smoldtb_value* val);
+bool dtb_reader_next_pair(dtb_cell_reader* reader, dtb_pair layout, dtb_pair* val);
+bool dtb_reader_next_triplet(dtb_cell_reader* reader, dtb_triplet layout, dtb_triplet* val);
+bool dtb_reader_next_quad(dtb_cell_reader* reader, dtb_quad layout, dtb_quad* val);
+
+bool dtb_translate_address(dtb_node* node, smoldtb_value bus_addr, smoldtb_value* cpu_addr);
+size_t dtb_read_reg_translated(dtb_node* node, dtb_pair* vals);
+size_t dtb_resolve_interrupts(dtb_node* node, dtb_interrupt* out, size_t max);
+dtb_node* dtb_find_by_address(smoldtb_value addr);
+
+/* Readers specialised for commonly used layouts. The name is the generic function followed by
+ * the layout, e.g. dtb_read_prop_2_2_1() is dtb_read_prop_2() with a layout of { 2, 1 }.
+ */
+#define SMOLDTB_FIXED_LAYOUTS_1(X) X(1) X(2)
+#define SMOLDTB_FIXED_LAYOUTS_2(X) X(1, 1) X(1, 2) X(2, 1) X(2, 2)
+#define SMOLDTB_FIXED_LAYOUTS_3(X) X(3, 2, 2)
+
+#define SMOLDTB_DECLARE_READ_1(x) size_t dtb_read_prop_1_##x(dtb_prop* prop, smoldtb_value* vals);
+#define SMOLDTB_DECLARE_READ_2(x, y) size_t dtb_read_prop_2_##x##_##y(dtb_prop* prop, dtb_pair* vals);
+#define SMOLDTB_DECLARE_READ_3(x, y, z) size_t dtb_read_prop_3_##x##_##y##_##z(dtb_prop* prop, dtb_triplet* vals);
+
+SMOLDTB_FIXED_LAYOUTS_1(SMOLDTB_DECLARE_READ_1)
+SMOLDTB_FIXED_LAYOUTS_2(SMOLDTB_DECLARE_READ_2)
+SMOLDTB_FIXED_LAYOUTS_3(SMOLDTB_DECLARE_READ_3)
+
+/* Contexts hold a parsed tree, so that several trees can be used at the same time. Every
+ * function that uses the parser's state has a version named dtb_ctx_*() (e.g. dtb_ctx_find())
+ * that takes the context as the first argument, the functions above use the default context.
+ * The list is used to declare (and define) these, X(return type, name, parameters, arguments).
+ * Contexts are only available when SMOLDTB_ENABLE_CONTEXTS is defined (snapshots are built on
+ * them, so SMOLDTB_ENABLE_SNAPSHOTS defines it too). The context in use is then tracked per
+ * thread, so freestanding builds must also define SMOLDTB_THREAD_LOCAL.
+ */
+#if defined(SMOLDTB_ENABLE_SNAPSHOTS) && !defined(SMOLDTB_ENABLE_CONTEXTS)
+#define SMOLDTB_ENABLE_CONTEXTS
+#endif
+
+#ifdef SMOLDTB_ENABLE_CONTEXTS
+dtb_ctx* dtb_ctx_create(dtb_ops ops);
+void dtb_ctx_destroy(dtb_ctx* ctx);
+#endif
+
+#define SMOLDTB_CTX_FUNCS(X) \
+    X(bool, init, (dtb_ctx* ctx, uintptr_t start, dtb_ops ops), (start, ops)) \
+    X(dtb_node*, find_compatible, (dtb_ctx* ctx, dtb_node* node, const char* str), (node, str)) \
+    X(dtb_node*, find_compatible_in, (dtb_ctx* ctx, dtb_node* subtree, dtb_node* start, const char* str), (subtree, start, str)) \
+    X(dtb_node*, find_phandle, (dtb_ctx* ctx, unsigned handle), (handle)) \
+    X(size_t, match_compatible, (dtb_ctx* ctx, const char* const* table, size_t table_count, dtb_match* matches, size_t match_count), (table, table_count, matches, match_count)) \
+    X(dtb_node*, find, (dtb_ctx* ctx, const char* path), (path)) \
+    X(dtb_node*, find_child, (dtb_ctx* ctx, dtb_node* node, const char* name), (node, name)) \
+    X(dtb_prop*, find_prop, (dtb_ctx* ctx, dtb_node* node, const char* name), (node, name)) \
+    X(dtb_atom, intern, (dtb_ctx* ctx, const char* name), (name)) \
+    X(dtb_prop*, find_prop_atom, (dtb_ctx* ctx, dtb_node* node, dtb_atom atom), (node, atom)) \
+    X(dtb_node*, get_sibling, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(dtb_node*, get_child, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(dtb_node*, get_parent, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(size_t, get_path, (dtb_ctx* ctx, dtb_node* node, char* buff, size_t buff_len), (node, buff, buff_len)) \
+    X(dtb_prop*, get_prop, (dtb_ctx* ctx, dtb_node* node, size_t index), (node, index)) \
+    X(dtb_prop_iter, get_prop_iter, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(dtb_prop*, prop_next, (dtb_ctx* ctx, dtb_prop_iter* iter), (iter)) \
+    X(dtb_child_iter, get_child_iter, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(dtb_node*, child_next, (dtb_ctx* ctx, dtb_child_iter* iter), (iter)) \
+    X(size_t, get_addr_cells_of, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(size_t, get_size_cells_of, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(size_t, get_addr_cells_for, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(size_t, get_size_cells_for, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(bool, is_compatible, (dtb_ctx* ctx, dtb_node* node, const char* str), (node, str)) \
+    X(bool, is_enabled, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(bool, stat_node, (dtb_ctx* ctx, dtb_node* node, dtb_node_stat* stat), (node, stat)) \
+    X(bool, stat_prop, (dtb_ctx* ctx, dtb_prop* prop, dtb_prop_stat* stat), (prop, stat)) \
+    X(size_t, read_resv_memory, (dtb_ctx* ctx, size_t entry_count, dtb_reserved_memory* vals), (entry_count, vals)) \
+    X(size_t, build_memory_map, (dtb_ctx* ctx, dtb_memory_range* ranges, size_t max), (ranges, max)) \
+    X(const char*, read_prop_string, (dtb_ctx* ctx, dtb_prop* prop, size_t index), (prop, index)) \
+    X(dtb_string_iter, get_string_iter, (dtb_ctx* ctx, dtb_prop* prop), (prop)) \
+    X(const char*, string_next, (dtb_ctx* ctx, dtb_string_iter* iter, size_t* len), (iter, len)) \
+    X(size_t, find_string_index, (dtb_ctx* ctx, dtb_prop* prop, const char* str), (prop, str)) \
+    X(size_t, read_prop_1, (dtb_ctx* ctx, dtb_prop* prop, size_t cell_count, smoldtb_value* vals), (prop, cell_count, vals)) \
+    X(size_t, read_prop_2, (dtb_ctx* ctx, dtb_prop* prop, dtb_pair layout, dtb_pair* vals), (prop, layout, vals)) \
+    X(size_t, read_prop_3, (dtb_ctx* ctx, dtb_prop* prop, dtb_triplet layout, dtb_triplet* vals), (prop, layout, vals)) \
+    X(size_t, read_prop_4, (dtb_ctx* ctx, dtb_prop* prop, dtb_quad layout, dtb_quad* vals), (prop, layout, vals)) \
+    X(dtb_cell_reader, get_cell_reader, (dtb_ctx* ctx, dtb_prop* prop), (prop)) \
+    X(bool, translate_address, (dtb_ctx* ctx, dtb_node* node, smoldtb_value bus_addr, smoldtb_value* cpu_addr), (node, bus_addr, cpu_addr)) \
+    X(size_t, read_reg_translated, (dtb_ctx* ctx, dtb_node* node, dtb_pair* vals), (node, vals)) \
+    X(size_t, resolve_interrupts, (dtb_ctx* ctx, dtb_node* node, dtb_interrupt* out, size_t max), (node, out, max)) \
+    X(dtb_node*, find_by_address, (dtb_ctx* ctx, smoldtb_value addr), (addr))
+
+#define SMOLDTB_DECLARE_CTX(ret, name, params, args) ret dtb_ctx_##name params;
+#define SMOLDTB_DECLARE_CTX_READ_1(x) size_t dtb_ctx_read_prop_1_##x(dtb_ctx* ctx, dtb_prop* prop, smoldtb_value* vals);
+#define SMOLDTB_DECLARE_CTX_READ_2(x, y) size_t dtb_ctx_read_prop_2_##x##_##y(dtb_ctx* ctx, dtb_prop* prop, dtb_pair* vals);
+#define SMOLDTB_DECLARE_CTX_READ_3(x, y, z) size_t dtb_ctx_read_prop_3_##x##_##y##_##z(dtb_ctx* ctx, dtb_prop* prop, dtb_triplet* vals);
+
+#ifdef SMOLDTB_ENABLE_CONTEXTS
+SMOLDTB_CTX_FUNCS(SMOLDTB_DECLARE_CTX)
+SMOLDTB_FIXED_LAYOUTS_1(SMOLDTB_DECLARE_CTX_READ_1)
+SMOLDTB_FIXED_LAYOUTS_2(SMOLDTB_DECLARE_CTX_READ_2)
+SMOLDTB_FIXED_LAYOUTS_3(SMOLDTB_DECLARE_CTX_READ_3)
+#endif
+
+#ifdef SMOLDTB_ENABLE_SNAPSHOTS
+typedef struct
+{
+    dtb_ctx* ctx;
+    size_t epoch;
+} dtb_snapshot;
+
+bool dtb_snapshot_publish(uintptr_t start, dtb_ops ops);
+dtb_snapshot dtb_snapshot_enter(void);
+void dtb_snapshot_exit(dtb_snapshot snapshot);
+#endif
+
+#ifdef SMOLDTB_ENABLE_STREAMING
+#define SMOLDTB_FEED_FAILURE ((size_t)-1)
+
+bool dtb_init_stream(dtb_ops ops);
+size_t dtb_feed(const void* chunk, size_t length);
+
+#define SMOLDTB_CTX_STREAM_FUNCS(X) \
+    X(bool, init_stream, (dtb_ctx* ctx, dtb_ops ops), (ops)) \
+    X(size_t, feed, (dtb_ctx* ctx, const void* chunk, size_t length), (chunk, length))
+
+#ifdef SMOLDTB_ENABLE_CONTEXTS
+SMOLDTB_CTX_STREAM_FUNCS(SMOLDTB_DECLARE_CTX)
+#endif
+#endif
+
 #ifdef SMOLDTB_ENABLE_WRITE_API
 
 #define SMOLDTB_FINALISE_FAILURE ((size_t)-1)
@@ -116,6 +336,25 @@ bool dtb_write_prop_1(dtb_prop* prop, size_t count, size_t cell_count, const smo
 bool dtb_write_prop_2(dtb_prop* prop, size_t count, dtb_pair layout, const dtb_pair* vals);
 bool dtb_write_prop_3(dtb_prop* prop, size_t count, dtb_triplet layout, const dtb_triplet* vals);
 bool dtb_write_prop_4(dtb_prop* prop, size_t count, dtb_quad layout, const dtb_quad* vals);
+
+#define SMOLDTB_CTX_WRITE_FUNCS(X) \
+    X(size_t, finalise_to_buffer, (dtb_ctx* ctx, void* buffer, size_t buffer_size, uint32_t boot_cpu_id, dtb_reserved_memory* resv, size_t resv_count), (buffer, buffer_size, boot_cpu_id, resv, resv_count)) \
+    X(dtb_node*, find_or_create_node, (dtb_ctx* ctx, const char* path), (path)) \
+    X(dtb_prop*, find_or_create_prop, (dtb_ctx* ctx, dtb_node* node, const char* name), (node, name)) \
+    X(dtb_node*, create_sibling, (dtb_ctx* ctx, dtb_node* node, const char* name), (node, name)) \
+    X(dtb_node*, create_child, (dtb_ctx* ctx, dtb_node* node, const char* name), (node, name)) \
+    X(dtb_prop*, create_prop, (dtb_ctx* ctx, dtb_node* node, const char* name), (node, name)) \
+    X(bool, destroy_node, (dtb_ctx* ctx, dtb_node* node), (node)) \
+    X(bool, destroy_prop, (dtb_ctx* ctx, dtb_prop* prop), (prop)) \
+    X(bool, write_prop_string, (dtb_ctx* ctx, dtb_prop* prop, const char* str, size_t str_len), (prop, str, str_len)) \
+    X(bool, write_prop_1, (dtb_ctx* ctx, dtb_prop* prop, size_t count, size_t cell_count, const smoldtb_value* vals), (prop, count, cell_count, vals)) \
+    X(bool, write_prop_2, (dtb_ctx* ctx, dtb_prop* prop, size_t count, dtb_pair layout, const dtb_pair* vals), (prop, count, layout, vals)) \
+    X(bool, write_prop_3, (dtb_ctx* ctx, dtb_prop* prop, size_t count, dtb_triplet layout, const dtb_triplet* vals), (prop, count, layout, vals)) \
+    X(bool, write_prop_4, (dtb_ctx* ctx, dtb_prop* prop, size_t count, dtb_quad layout, const dtb_quad* vals), (prop, count, layout, vals))
+
+#ifdef SMOLDTB_ENABLE_CONTEXTS
+SMOLDTB_CTX_WRITE_FUNCS(SMOLDTB_DECLARE_CTX)
+#endif
 #endif
 
 #ifdef __cplusplus
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -66,12 +67,10 @@ static void print_node(dtb_node* node, char* indent_buff, int indent, bool is_la
     else
         printf("<failed to stat node>\r\n");
 
-    for (size_t i = 0; i < stat.prop_count; i++)
+    dtb_prop_iter props = dtb_get_prop_iter(node);
+    dtb_prop* prop;
+    while ((prop = dtb_prop_next(&props)) != NULL)
     {
-        dtb_prop* prop = dtb_get_prop(node, i);
-        if (prop == NULL)
-            break;
-
         dtb_prop_stat pstat;
         if (dtb_stat_prop(prop, &pstat))
             printf("%.*s %s: %zu bytes\r\n", indent, indent_buff, pstat.name, pstat.data_len);
@@ -79,10 +78,11 @@ static void print_node(dtb_node* node, char* indent_buff, int indent, bool is_la
             printf("%.*s <failed to stat property>\r\n", indent, indent_buff);
     }
 
-    dtb_node* child = dtb_get_child(node);
+    dtb_child_iter children = dtb_get_child_iter(node);
+    dtb_node* child = dtb_child_next(&children);
     while (child != NULL)
     {
-        dtb_node* next = dtb_get_sibling(child);
+        dtb_node* next = dtb_child_next(&children);
         print_node(child, indent_buff, indent, next == NULL);
         child = next;
     }
@@ -143,7 +143,7 @@ static void display_file(const char* filename, const char* output_filename)
         return;
     }
 
-    dtb_ops ops;
+    dtb_ops ops = { 0 };
     ops.malloc = dtb_malloc;
     ops.free = dtb_free;
     ops.on_error = dtb_on_error;
@@ -165,15 +165,475 @@ static void display_file(const char* filename, const char* output_filename)
     close(fd);
 }
 
+/* ---- Self tests, run with --test ---- */
+
+static size_t failed_checks = 0;
+static size_t test_errors = 0;
+
+static void check(bool passed, const char* what)
+{
+    printf("%s: %s\r\n", passed ? "pass" : "FAIL", what);
+    if (!passed)
+        failed_checks++;
+}
+
+static void test_on_error(const char* why)
+{
+    (void)why;
+    test_errors++;
+}
+
+static void* test_malloc(size_t length)
+{
+    return malloc(length);
+}
+
+static void test_free(void* ptr, size_t length)
+{
+    (void)length;
+    free(ptr);
+}
+
+static dtb_ops test_ops()
+{
+    dtb_ops ops = { 0 };
+    ops.malloc = test_malloc;
+    ops.free = test_free;
+    ops.on_error = test_on_error;
+    return ops;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t length)
+{
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull; //FNV-1a
+    }
+    return hash;
+}
+
+/* Hashes the names, properties and shape of a subtree, to compare two parses of the same blob. */
+static uint64_t hash_node(dtb_node* node, uint64_t hash)
+{
+    dtb_node_stat stat;
+    if (!dtb_stat_node(node, &stat))
+        return 0;
+    hash = hash_bytes(hash, stat.name, strlen(stat.name) + 1);
+    hash = hash_bytes(hash, &stat.prop_count, sizeof(stat.prop_count));
+    hash = hash_bytes(hash, &stat.child_count, sizeof(stat.child_count));
+
+    dtb_prop_iter props = dtb_get_prop_iter(node);
+    dtb_prop* prop;
+    while ((prop = dtb_prop_next(&props)) != NULL)
+    {
+        dtb_prop_stat pstat;
+        if (!dtb_stat_prop(prop, &pstat))
+            return 0;
+        hash = hash_bytes(hash, pstat.name, strlen(pstat.name) + 1);
+        hash = hash_bytes(hash, &pstat.data_len, sizeof(pstat.data_len));
+        hash = hash_bytes(hash, pstat.data, pstat.data_len);
+    }
+
+    dtb_child_iter children = dtb_get_child_iter(node);
+    dtb_node* child;
+    while ((child = dtb_child_next(&children)) != NULL)
+        hash = hash_node(child, hash);
+    return hash;
+}
+
+static uint64_t hash_tree()
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (dtb_node* root = dtb_find("/"); root != NULL; root = dtb_get_sibling(root))
+        hash = hash_node(root, hash);
+    return hash;
+}
+
+/* Builds small blobs for the walker tests, with an empty memory reservation block */
+struct test_blob
+{
+    uint64_t data[256];
+    uint8_t structs[1024];
+    size_t struct_len;
+    char strings[256];
+    size_t strings_len;
+};
+
+static void put_be32(uint8_t* dest, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+        dest[i] = (uint8_t)(value >> (24 - i * 8));
+}
+
+static void blob_bytes(struct test_blob* blob, const void* data, size_t length)
+{
+    if (length != 0)
+        memcpy(blob->structs + blob->struct_len, data, length);
+    blob->struct_len += length;
+    while (blob->struct_len % 4 != 0)
+        blob->structs[blob->struct_len++] = 0;
+}
+
+static void blob_cell(struct test_blob* blob, uint32_t value)
+{
+    put_be32(blob->structs + blob->struct_len, value);
+    blob->struct_len += 4;
+}
+
+static void blob_begin(struct test_blob* blob, const char* name)
+{
+    blob_cell(blob, 1); //FDT_BEGIN_NODE
+    blob_bytes(blob, name, strlen(name) + 1);
+}
+
+static void blob_prop(struct test_blob* blob, const char* name, const void* data, size_t length)
+{
+    blob_cell(blob, 3); //FDT_PROP
+    blob_cell(blob, length);
+    blob_cell(blob, blob->strings_len);
+    blob_bytes(blob, data, length);
+    memcpy(blob->strings + blob->strings_len, name, strlen(name) + 1);
+    blob->strings_len += strlen(name) + 1;
+}
+
+static void blob_prop_cell(struct test_blob* blob, const char* name, uint32_t value)
+{
+    uint8_t data[4];
+    put_be32(data, value);
+    blob_prop(blob, name, data, sizeof(data));
+}
+
+static void blob_end(struct test_blob* blob)
+{
+    blob_cell(blob, 2); //FDT_END_NODE
+}
+
+static uintptr_t blob_finish(struct test_blob* blob)
+{
+    blob_cell(blob, 9); //FDT_END
+
+    uint8_t* data = (uint8_t*)blob->data;
+    const size_t struct_offset = 40 + 16;
+    const size_t strings_offset = struct_offset + blob->struct_len;
+    memset(data, 0, struct_offset);
+    put_be32(data + 0, 0xd00dfeed);
+    put_be32(data + 4, strings_offset + blob->strings_len);
+    put_be32(data + 8, struct_offset);
+    put_be32(data + 12, strings_offset);
+    put_be32(data + 16, 40);
+    put_be32(data + 20, 17);
+    put_be32(data + 24, 16);
+    put_be32(data + 32, blob->strings_len);
+    put_be32(data + 36, blob->struct_len);
+    memcpy(data + struct_offset, blob->structs, blob->struct_len);
+    memcpy(data + strings_offset, blob->strings, blob->strings_len);
+    return (uintptr_t)data;
+}
+
+/* Records each walker event as a line of text, and what to do when a node begins */
+struct walk_log
+{
+    char text[1024];
+    size_t length;
+    const char* skip_name;
+    const char* stop_name;
+};
+
+static void log_event(struct walk_log* log, const char* kind, const char* name, const dtb_walk_context* context)
+{
+    log->length += snprintf(log->text + log->length, sizeof(log->text) - log->length, "%s %s %zu %zu/%zu\n",
+        kind, name, context->depth, context->addr_cells, context->size_cells);
+}
+
+static int walk_begin_node(const char* name, const dtb_walk_context* context, void* opaque)
+{
+    struct walk_log* log = opaque;
+    log_event(log, "begin", name[0] == 0 ? "/" : name, context);
+    if (log->stop_name != NULL && strcmp(name, log->stop_name) == 0)
+        return SMOLDTB_WALK_STOP;
+    if (log->skip_name != NULL && strcmp(name, log->skip_name) == 0)
+        return SMOLDTB_WALK_SKIP;
+    return SMOLDTB_WALK_CONTINUE;
+}
+
+static int walk_prop(const char* name, const void* data, size_t length, const dtb_walk_context* context, void* opaque)
+{
+    (void)data;
+    (void)length;
+    log_event(opaque, "prop", name, context);
+    return SMOLDTB_WALK_CONTINUE;
+}
+
+static int walk_end_node(const dtb_walk_context* context, void* opaque)
+{
+    log_event(opaque, "end", "-", context);
+    return SMOLDTB_WALK_CONTINUE;
+}
+
+static bool walk_matches(uintptr_t blob, const char* skip_name, const char* stop_name, const char* expected)
+{
+    dtb_walk_callbacks callbacks = { walk_begin_node, walk_prop, walk_end_node };
+    struct walk_log log;
+    log.length = 0;
+    log.text[0] = 0;
+    log.skip_name = skip_name;
+    log.stop_name = stop_name;
+    if (!dtb_walk(blob, &callbacks, &log))
+        return false;
+    if (strcmp(log.text, expected) == 0)
+        return true;
+
+    printf("walk events:\r\n%s", log.text);
+    return false;
+}
+
+static void test_walk()
+{
+    static struct test_blob blob;
+    static const uint8_t reg[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    blob_begin(&blob, "");
+        blob_prop_cell(&blob, "#address-cells", 1);
+        blob_prop_cell(&blob, "#size-cells", 1);
+        blob_begin(&blob, "bus@0");
+            blob_prop_cell(&blob, "#address-cells", 2);
+            blob_prop_cell(&blob, "#size-cells", 0);
+            blob_begin(&blob, "dev@1");
+                blob_prop(&blob, "reg", reg, sizeof(reg));
+                blob_begin(&blob, "leaf");
+                    blob_prop(&blob, "empty", NULL, 0);
+                blob_end(&blob);
+            blob_end(&blob);
+        blob_end(&blob);
+        blob_begin(&blob, "skipped");
+            blob_prop_cell(&blob, "#address-cells", 3);
+            blob_begin(&blob, "inner");
+            blob_end(&blob);
+        blob_end(&blob);
+        blob_begin(&blob, "last");
+        blob_end(&blob);
+    blob_end(&blob);
+    const uintptr_t start = blob_finish(&blob);
+
+    /* cells come from the parent only, so leaf gets the defaults rather than bus@0's */
+    check(walk_matches(start, NULL, NULL,
+        "begin / 0 2/1\n"
+        "prop #address-cells 0 2/1\n"
+        "prop #size-cells 0 2/1\n"
+        "begin bus@0 1 1/1\n"
+        "prop #address-cells 1 1/1\n"
+        "prop #size-cells 1 1/1\n"
+        "begin dev@1 2 2/0\n"
+        "prop reg 2 2/0\n"
+        "begin leaf 3 2/1\n"
+        "prop empty 3 2/1\n"
+        "end - 3 2/1\n"
+        "end - 2 2/0\n"
+        "end - 1 1/1\n"
+        "begin skipped 1 1/1\n"
+        "prop #address-cells 1 1/1\n"
+        "begin inner 2 3/1\n"
+        "end - 2 3/1\n"
+        "end - 1 1/1\n"
+        "begin last 1 1/1\n"
+        "end - 1 1/1\n"
+        "end - 0 2/1\n"), "walk: events, depths and cells");
+
+    check(walk_matches(start, "skipped", NULL,
+        "begin / 0 2/1\n"
+        "prop #address-cells 0 2/1\n"
+        "prop #size-cells 0 2/1\n"
+        "begin bus@0 1 1/1\n"
+        "prop #address-cells 1 1/1\n"
+        "prop #size-cells 1 1/1\n"
+        "begin dev@1 2 2/0\n"
+        "prop reg 2 2/0\n"
+        "begin leaf 3 2/1\n"
+        "prop empty 3 2/1\n"
+        "end - 3 2/1\n"
+        "end - 2 2/0\n"
+        "end - 1 1/1\n"
+        "begin skipped 1 1/1\n"
+        "end - 1 1/1\n"
+        "begin last 1 1/1\n"
+        "end - 1 1/1\n"
+        "end - 0 2/1\n"), "walk: SMOLDTB_WALK_SKIP skips a subtree");
+
+    check(walk_matches(start, NULL, "dev@1",
+        "begin / 0 2/1\n"
+        "prop #address-cells 0 2/1\n"
+        "prop #size-cells 0 2/1\n"
+        "begin bus@0 1 1/1\n"
+        "prop #address-cells 1 1/1\n"
+        "prop #size-cells 1 1/1\n"
+        "begin dev@1 2 2/0\n"), "walk: SMOLDTB_WALK_STOP ends the walk");
+
+    /* the root plus SMOLDTB_WALK_MAX_DEPTH - 1 nested nodes fit, one more doesn't */
+    static struct test_blob deep;
+    for (size_t i = 0; i < SMOLDTB_WALK_MAX_DEPTH; i++)
+        blob_begin(&deep, i == 0 ? "" : "node");
+    for (size_t i = 0; i < SMOLDTB_WALK_MAX_DEPTH; i++)
+        blob_end(&deep);
+    dtb_walk_callbacks no_callbacks = { NULL, NULL, NULL };
+    check(dtb_walk(blob_finish(&deep), &no_callbacks, NULL), "walk: SMOLDTB_WALK_MAX_DEPTH levels of nodes");
+
+    static struct test_blob deeper;
+    for (size_t i = 0; i <= SMOLDTB_WALK_MAX_DEPTH; i++)
+        blob_begin(&deeper, i == 0 ? "" : "node");
+    for (size_t i = 0; i <= SMOLDTB_WALK_MAX_DEPTH; i++)
+        blob_end(&deeper);
+    check(!dtb_walk(blob_finish(&deeper), &no_callbacks, NULL), "walk: nesting past SMOLDTB_WALK_MAX_DEPTH fails");
+}
+
+#ifdef SMOLDTB_ENABLE_STREAMING
+/* Small odd sizes, so pieces start and end at every alignment */
+static const size_t piece_sizes[] = { 13, 7, 29, 3, 61, 11, 1, 37 };
+
+/* Feeds a blob to dtb_feed() in small pieces, each copied into its own (8-byte aligned) buffer at
+ * the same offset (modulo 8) as in the blob, so nothing can be read across a piece boundary. A
+ * piece also ends at each offset in splits. The buffers are returned in pieces (the tree uses
+ * them in place), along with the last value returned by dtb_feed().
+ */
+static size_t feed_in_pieces(const uint8_t* blob, size_t length, const size_t* splits, size_t split_count,
+    void** pieces, size_t* piece_count)
+{
+    size_t remaining = SMOLDTB_FEED_FAILURE;
+    size_t offset = 0;
+    *piece_count = 0;
+    while (offset < length)
+    {
+        size_t end = offset + piece_sizes[*piece_count % (sizeof(piece_sizes) / sizeof(piece_sizes[0]))];
+        for (size_t i = 0; i < split_count; i++)
+        {
+            if (splits[i] > offset && splits[i] < end)
+                end = splits[i];
+        }
+        if (end > length)
+            end = length;
+
+        uint8_t* piece = malloc(16 + end - offset);
+        pieces[(*piece_count)++] = piece;
+        memcpy(piece + offset % 8, blob + offset, end - offset);
+        remaining = dtb_feed(piece + offset % 8, end - offset);
+        if (remaining == SMOLDTB_FEED_FAILURE)
+            break;
+        offset = end;
+    }
+
+    return remaining;
+}
+
+static void free_pieces(void** pieces, size_t piece_count)
+{
+    for (size_t i = 0; i < piece_count; i++)
+        free(pieces[i]);
+}
+
+/* Streams the blob in small pieces and checks the result against dtb_init(), then checks that
+ * a blob with its struct block cut short is rejected.
+ */
+static void test_streaming(const uint8_t* blob, size_t length)
+{
+    dtb_init((uintptr_t)blob, test_ops());
+    const uint64_t expected = hash_tree();
+
+    /* make sure pieces end in the middle of a node name, property data and a property name */
+    size_t splits[3];
+    size_t split_count = 0;
+    dtb_node* node = dtb_get_child(dtb_find("/"));
+    dtb_node_stat stat;
+    if (node != NULL && dtb_stat_node(node, &stat) && strlen(stat.name) > 1)
+        splits[split_count++] = (const uint8_t*)stat.name - blob + 1;
+    dtb_prop_iter props = dtb_get_prop_iter(node);
+    dtb_prop* prop;
+    while ((prop = dtb_prop_next(&props)) != NULL && split_count < 3)
+    {
+        dtb_prop_stat pstat;
+        if (dtb_stat_prop(prop, &pstat) && pstat.data_len > 1 && strlen(pstat.name) > 1)
+        {
+            splits[split_count++] = (const uint8_t*)pstat.data - blob + 1;
+            splits[split_count++] = (const uint8_t*)pstat.name - blob + 1;
+        }
+    }
+    check(split_count == 3, "stream: found a node name, property data and a string to split");
+
+    void** pieces = malloc(length * sizeof(void*));
+    size_t piece_count;
+    test_errors = 0;
+    check(dtb_init_stream(test_ops()), "stream: dtb_init_stream()");
+    const size_t remaining = feed_in_pieces(blob, length, splits, split_count, pieces, &piece_count);
+    check(remaining == 0 && test_errors == 0, "stream: whole blob fed in small pieces");
+    check(hash_tree() == expected, "stream: tree matches dtb_init()");
+    check(dtb_feed(blob, 8) == 0, "stream: feeding after the end is ignored");
+    free_pieces(pieces, piece_count);
+
+    uint8_t* truncated = malloc(length);
+    memcpy(truncated, blob, length);
+    /* size_structs is the 10th cell of the header, big endian */
+    uint8_t* size_structs = truncated + 9 * sizeof(uint32_t);
+    const uint32_t size = ((uint32_t)size_structs[0] << 24) | ((uint32_t)size_structs[1] << 16)
+        | ((uint32_t)size_structs[2] << 8) | size_structs[3];
+    const uint32_t cut_size = (size / 2) & ~3u;
+    for (size_t i = 0; i < 4; i++)
+        size_structs[i] = (uint8_t)(cut_size >> (24 - i * 8));
+    test_errors = 0;
+    dtb_init_stream(test_ops());
+    check(feed_in_pieces(truncated, length, NULL, 0, pieces, &piece_count) == SMOLDTB_FEED_FAILURE
+        && test_errors != 0, "stream: truncated struct block fails");
+    check(dtb_find("/") == NULL, "stream: tree is empty after a failure");
+    free_pieces(pieces, piece_count);
+    free(truncated);
+    free(pieces);
+}
+#endif
+
+static int run_tests(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        printf("Could not open file %s\r\n", filename);
+        return 1;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1)
+    {
+        printf("Could not stat file %s\r\n", filename);
+        return 1;
+    }
+
+    void* buffer = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buffer == MAP_FAILED)
+    {
+        printf("mmap() failed\r\n");
+        return 1;
+    }
+
+    test_walk();
+#ifdef SMOLDTB_ENABLE_STREAMING
+    test_streaming(buffer, sb.st_size);
+#endif
+
+    munmap(buffer, sb.st_size);
+    close(fd);
+
+    printf("%zu checks failed\r\n", failed_checks);
+    return failed_checks == 0 ? 0 : 1;
+}
+
 void show_usage()
 {
     printf("Usage: \n\
     readfdt <filename.dtb> [output_filename] \n\
+    readfdt --test <filename.dtb> \n\
     \n\
     This program will parse a flattened device tree/device tree blob and \n\
     output a summary of it's contents. \n\
     If [output_filename] is provided, smoldtb will print it's internal representation \n\
     of the device tree to the specified file in the FDT format. \n\
+    With --test, it runs smoldtb's self tests against the file instead. \n\
     The intended purpose of this program is for testing smoldtb library code. \n\
     ");
 }
@@ -186,6 +646,9 @@ int main(int argc, char** argv)
         return 0;
     }
 
+    if (argc == 3 && strcmp(argv[1], "--test") == 0)
+        return run_tests(argv[2]);
+
     const char* output_filename = NULL;
     if (argc == 3)
         output_filename = argv[2];